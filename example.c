@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include "tinyrl.h"
@@ -68,11 +69,24 @@ static bool enter_key(void *context, char *key)
 	return false;
 }
 
+static void window_changed(int sig)
+{
+	tinyrl_window_changed();
+}
+
 int main(int argc, char *argv[])
 {
 	struct tinyrl_history *history;
+	struct sigaction sa;
 	struct tinyrl *t;
-	char *line;
+	const char *line;
+	size_t len;
+
+	/* no SA_RESTART, so that a resize is shown straight away */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = window_changed;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGWINCH, &sa, NULL);
 
 	t = tinyrl_new(stdin, stdout);
 	tinyrl_bind_key(t, '\t', tab_key, t);
@@ -82,19 +96,16 @@ int main(int argc, char *argv[])
 	history = tinyrl_history_new(t, 0);
 
 	for (;;) {
-		line = tinyrl_readline(t, "> ");
+		line = tinyrl_readline_view(t, "> ", &len);
 		if (!line)
 			break;
 
-		if (strcmp(line, "exit") == 0) {
-			free(line);
+		if (strcmp(line, "exit") == 0)
 			break;
-		}
 
 		printf("echo: %s\n", line);
 
 		tinyrl_history_add(history, line);
-		free(line);
 	}
 
 	tinyrl_history_delete(history);
@@ -0,0 +1,108 @@
+/*
+ * histbench.c
+ *
+ * Benchmark for going through the history with Up and Down, when prefix
+ * search is on and many entries start with the text typed.  The history
+ * holds distinct entries which all share a one character prefix, then
+ * the same with each line repeated, so that Up and Down have to skip
+ * the copies of the line they are on.  The time for the first Up, which
+ * finds the entries, and for each Up and Down after it is reported, and
+ * each must land on the entry expected.
+ *
+ * usage: histbench [entries...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tinyrl.h"
+#include "history.h"
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* feed a key, and check that it went to the entry numbered want */
+static bool key(struct tinyrl *t, const char *seq, unsigned want)
+{
+	char text[32];
+	size_t len;
+
+	tinyrl_feed(t, seq, strlen(seq));
+	tinyrl_output(t, &len);
+	tinyrl_output_consume(t, len);
+
+	sprintf(text, "x%u", want);
+	return strcmp(tinyrl_get_line(t), text) == 0;
+}
+
+/* go up and back down through entries, each added step times */
+static void run(const char *name, unsigned count, unsigned step)
+{
+	struct tinyrl *t = tinyrl_session_new();
+	struct tinyrl_history *history = tinyrl_history_new(t, 0);
+	unsigned keys = count / step - 1 < 1000 ? count / step - 1 : 1000;
+	unsigned i, want;
+	char text[32];
+	double start, first, up, down;
+	bool ok = true;
+
+	tinyrl_history_enable_prefix_search(history);
+	for (i = 0; i < count; i++) {
+		sprintf(text, "x%u", i / step * step);
+		tinyrl_history_add(history, text);
+	}
+
+	/* the first line finds the entries and sorts them by text */
+	tinyrl_feed_start(t, "> ");
+	tinyrl_feed(t, "x", 1);
+	key(t, "\x1b[A", 0);
+	tinyrl_feed(t, "\r", 1);
+
+	tinyrl_feed_start(t, "> ");
+	tinyrl_feed(t, "x", 1);
+	want = (count - 1) / step * step;
+	start = now_ms();
+	ok &= key(t, "\x1b[A", want);
+	first = now_ms() - start;
+
+	start = now_ms();
+	for (i = 0; i < keys; i++)
+		ok &= key(t, "\x1b[A", want -= step);
+	up = (now_ms() - start) / keys;
+
+	start = now_ms();
+	for (i = 0; i < keys; i++)
+		ok &= key(t, "\x1b[B", want += step);
+	down = (now_ms() - start) / keys;
+
+	printf("%-9s %7u: first %8.3fms, up %8.4fms, down %8.4fms%s\n",
+	       name, count, first, up, down, ok ? "" : " (wrong entry)");
+
+	tinyrl_history_delete(history);
+	tinyrl_delete(t);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *defaults[] = { "1000", "100000" };
+	const char **counts = defaults;
+	int count = 2;
+	int i;
+
+	if (argc > 1) {
+		counts = (const char **)argv + 1;
+		count = argc - 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		run("distinct", atoi(counts[i]), 1);
+		run("repeated", atoi(counts[i]), 4);
+	}
+
+	return 0;
+}
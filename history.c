@@ -6,31 +6,731 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <stdlib.h>
 
 #include "tinyrl.h"
 #include "history.h"
 
+#define CHUNK_SIZE 4096
+#define SORTED_BLOCK 256
+
+/*
+ * a block of memory which the text of entries is appended to, or the
+ * mapping of a history file which entries were loaded from
+ */
+struct chunk {
+	unsigned entries;	/* number of entries still using the chunk */
+	size_t used;
+	size_t size;
+	char *map;
+	char text[];
+};
+
+struct entry {
+	const char *text;
+	struct chunk *chunk;
+	unsigned id;		/* increases with each entry added */
+};
+
+/* an entry in the list of entries sorted by text, then by id */
+struct sorted_entry {
+	const char *text;
+	unsigned id;
+};
+
+/*
+ * The sorted entries are kept in blocks, so that adding or removing one
+ * only moves the rest of its block.
+ */
+struct sorted_block {
+	unsigned count;
+	struct sorted_entry entries[SORTED_BLOCK];
+};
+
+/* a place in the sorted entries */
+struct sorted_pos {
+	unsigned block;
+	unsigned offset;
+};
+
+/*
+ * an entry with the prefix, with the nearest older and newer ones whose
+ * text is different, or UINT_MAX if there are none
+ */
+struct prefix_match {
+	const char *text;
+	unsigned id;
+	unsigned older;
+	unsigned newer;
+};
+
+/* the ids of the entries which contain three bytes, oldest first */
+struct postings {
+	unsigned gram;		/* the bytes, or 0 for an empty slot */
+	unsigned count;
+	unsigned size;
+	unsigned *ids;
+};
+
 struct tinyrl_history {
 	struct tinyrl *tinyrl;
-	char **entries;	/* pointer entries */
+	struct entry *entries;	/* circular array of entries */
+	struct chunk *chunk;	/* the chunk being appended to */
+	unsigned first;		/* slot of the oldest entry */
 	unsigned length;	/* Number of elements within this array */
 	unsigned size;		/* Number of slots allocated in this array */
 	unsigned limit;
 	unsigned iter;
+	int fd;			/* file which added lines are appended to */
+
+	/* a hash table of the trigrams in the entries, built for the
+	 * first search and then kept up to date */
+	struct postings *grams;
+	unsigned grams_size;
+	unsigned grams_used;
+	size_t postings;
+	size_t stale;		/* postings of entries which are gone */
+	unsigned next_id;
+	bool indexed;
+
+	/* the entries sorted by text, for finding those with a prefix,
+	 * built when first needed and then kept up to date */
+	struct sorted_block **sorted;
+	unsigned sorted_blocks;
+	unsigned sorted_size;
+	bool sorted_valid;
+
+	/* Up and Down only go to entries starting with the prefix, which
+	 * are found for the first key and kept in order until the history
+	 * or the prefix changes */
+	bool prefix_search;
+	char *prefix;
+	size_t prefix_len;
+	size_t prefix_size;
+	struct prefix_match *matches;
+	unsigned matches_count;
+	unsigned matches_size;
+	bool matched;
+
+	/* the incremental search in progress */
+	const char *prompt;	/* the prompt and line to go back to */
+	const char *line;
+	char *search_prompt;
+	char *query;
+	size_t query_len;
+	size_t query_size;
+	unsigned match;		/* position of the match shown, if any */
 };
 
+/* the slot holding the entry at the given position */
+static unsigned slot(const struct tinyrl_history *history, unsigned position)
+{
+	position += history->first;
+	if (position >= history->size)
+		position -= history->size;
+	return position;
+}
+
+static void index_free(struct tinyrl_history *history)
+{
+	unsigned i;
+
+	for (i = 0; i < history->grams_size; i++)
+		free(history->grams[i].ids);
+	free(history->grams);
+	history->grams = NULL;
+	history->grams_size = 0;
+	history->grams_used = 0;
+	history->postings = 0;
+	history->stale = 0;
+	history->indexed = false;
+}
+
+static void sorted_free(struct tinyrl_history *history)
+{
+	unsigned i;
+
+	for (i = 0; i < history->sorted_blocks; i++)
+		free(history->sorted[i]);
+	free(history->sorted);
+	history->sorted = NULL;
+	history->sorted_blocks = 0;
+	history->sorted_size = 0;
+	history->sorted_valid = false;
+}
+
+static int sorted_compare(const char *text, unsigned id,
+			  const struct sorted_entry *sorted)
+{
+	int result = strcmp(text, sorted->text);
+
+	if (result)
+		return result;
+	return (id > sorted->id) - (id < sorted->id);
+}
+
+static int sorted_qsort_compare(const void *a, const void *b)
+{
+	const struct sorted_entry *sorted = a;
+
+	return sorted_compare(sorted->text, sorted->id, b);
+}
+
+static const struct sorted_entry *
+sorted_at(const struct tinyrl_history *history, struct sorted_pos pos)
+{
+	return &history->sorted[pos.block]->entries[pos.offset];
+}
+
+static void sorted_next(const struct tinyrl_history *history,
+			struct sorted_pos *pos)
+{
+	if (++pos->offset == history->sorted[pos->block]->count) {
+		pos->block++;
+		pos->offset = 0;
+	}
+}
+
+/*
+ * Find the first sorted entry which isn't before the text and id, or
+ * the end, which is just past the last block.
+ */
+static struct sorted_pos sorted_search(const struct tinyrl_history *history,
+				       const char *text, unsigned id)
+{
+	const struct sorted_block *block;
+	struct sorted_pos pos;
+	unsigned lo = 0, hi = history->sorted_blocks, mid;
+
+	/* find the first block which doesn't end before it */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		block = history->sorted[mid];
+		if (sorted_compare(text, id, &block->entries[block->count - 1]) > 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	pos.block = lo;
+	pos.offset = 0;
+	if (pos.block == history->sorted_blocks)
+		return pos;
+
+	block = history->sorted[pos.block];
+	hi = block->count;
+	while (pos.offset < hi) {
+		mid = pos.offset + (hi - pos.offset) / 2;
+		if (sorted_compare(text, id, &block->entries[mid]) > 0)
+			pos.offset = mid + 1;
+		else
+			hi = mid;
+	}
+	return pos;
+}
+
+/* add an empty block at index, dropping the sorted entries on failure */
+static struct sorted_block *sorted_add_block(struct tinyrl_history *history,
+					     unsigned index)
+{
+	struct sorted_block **sorted;
+	struct sorted_block *block;
+
+	if (history->sorted_blocks == history->sorted_size) {
+		sorted = realloc(history->sorted,
+				 sizeof(*sorted) * (history->sorted_size * 2 + 8));
+		if (!sorted) {
+			sorted_free(history);
+			return NULL;
+		}
+		history->sorted = sorted;
+		history->sorted_size = history->sorted_size * 2 + 8;
+	}
+	block = malloc(sizeof(*block));
+	if (!block) {
+		sorted_free(history);
+		return NULL;
+	}
+	block->count = 0;
+	memmove(&history->sorted[index + 1], &history->sorted[index],
+		sizeof(*history->sorted) * (history->sorted_blocks - index));
+	history->sorted[index] = block;
+	history->sorted_blocks++;
+	return block;
+}
+
+static void sorted_build(struct tinyrl_history *history)
+{
+	struct sorted_entry *sorted;
+	struct sorted_block *block = NULL;
+	const struct entry *entry;
+	unsigned i;
+
+	sorted_free(history);
+	sorted = malloc(sizeof(*sorted) * (history->length + 1));
+	if (!sorted)
+		return;
+	for (i = 0; i < history->length; i++) {
+		entry = &history->entries[slot(history, i)];
+		sorted[i].text = entry->text;
+		sorted[i].id = entry->id;
+	}
+	qsort(sorted, history->length, sizeof(*sorted), sorted_qsort_compare);
+
+	/* fill blocks half way, leaving room to add more */
+	history->sorted_valid = true;
+	for (i = 0; i < history->length; i++) {
+		if (!block || block->count == SORTED_BLOCK / 2) {
+			block = sorted_add_block(history, history->sorted_blocks);
+			if (!block)
+				break;
+		}
+		block->entries[block->count++] = sorted[i];
+	}
+	free(sorted);
+}
+
+static void sorted_insert(struct tinyrl_history *history, const struct entry *entry)
+{
+	struct sorted_block *block = NULL;
+	struct sorted_block *next;
+	struct sorted_pos pos;
+
+	pos = sorted_search(history, entry->text, entry->id);
+	if (pos.block == history->sorted_blocks && pos.block) {
+		/* after the last entry, so at the end of the last block */
+		pos.block--;
+		pos.offset = history->sorted[pos.block]->count;
+	}
+	if (pos.block < history->sorted_blocks)
+		block = history->sorted[pos.block];
+
+	if (!block) {
+		block = sorted_add_block(history, pos.block);
+		if (!block)
+			return;
+	} else if (block->count == SORTED_BLOCK) {
+		/* split a full block in two */
+		next = sorted_add_block(history, pos.block + 1);
+		if (!next)
+			return;
+		next->count = SORTED_BLOCK / 2;
+		block->count -= next->count;
+		memcpy(next->entries, block->entries + block->count,
+		       sizeof(*next->entries) * next->count);
+		if (pos.offset > block->count) {
+			pos.offset -= block->count;
+			block = next;
+		}
+	}
+
+	memmove(&block->entries[pos.offset + 1], &block->entries[pos.offset],
+		sizeof(*block->entries) * (block->count - pos.offset));
+	block->entries[pos.offset].text = entry->text;
+	block->entries[pos.offset].id = entry->id;
+	block->count++;
+}
+
+static void sorted_remove(struct tinyrl_history *history, const struct entry *entry)
+{
+	struct sorted_block *block;
+	struct sorted_pos pos;
+
+	pos = sorted_search(history, entry->text, entry->id);
+	assert(pos.block < history->sorted_blocks
+	       && sorted_at(history, pos)->id == entry->id);
+
+	block = history->sorted[pos.block];
+	block->count--;
+	memmove(&block->entries[pos.offset], &block->entries[pos.offset + 1],
+		sizeof(*block->entries) * (block->count - pos.offset));
+	if (!block->count) {
+		free(block);
+		history->sorted_blocks--;
+		memmove(&history->sorted[pos.block], &history->sorted[pos.block + 1],
+			sizeof(*history->sorted) * (history->sorted_blocks - pos.block));
+	}
+}
+
+static unsigned gram_hash(unsigned gram)
+{
+	gram *= 2654435761u;
+	return gram ^ gram >> 16;
+}
+
+/* find the postings of a trigram, optionally adding them */
+static struct postings *index_find(struct tinyrl_history *history,
+				   unsigned gram, bool add)
+{
+	struct postings *grams;
+	unsigned size, mask, i, j;
+
+	if (add && (history->grams_used + 1) * 4 > history->grams_size * 3) {
+		/* rehash into a table twice the size */
+		size = history->grams_size ? history->grams_size * 2 : 1024;
+		grams = calloc(size, sizeof(*grams));
+		if (!grams)
+			return NULL;
+		for (i = 0; i < history->grams_size; i++) {
+			if (!history->grams[i].gram)
+				continue;
+			for (j = gram_hash(history->grams[i].gram) & (size - 1);
+			     grams[j].gram; j = (j + 1) & (size - 1))
+				;
+			grams[j] = history->grams[i];
+		}
+		free(history->grams);
+		history->grams = grams;
+		history->grams_size = size;
+	}
+	if (!history->grams_size)
+		return NULL;
+
+	mask = history->grams_size - 1;
+	for (i = gram_hash(gram) & mask; history->grams[i].gram; i = (i + 1) & mask)
+		if (history->grams[i].gram == gram)
+			return &history->grams[i];
+	if (!add)
+		return NULL;
+	history->grams[i].gram = gram;
+	history->grams_used++;
+	return &history->grams[i];
+}
+
+/* the trigram starting at text, or 0 if the text is shorter */
+static unsigned index_gram(const char *text)
+{
+	const unsigned char *s = (const unsigned char *)text;
+
+	if (!s[0] || !s[1] || !s[2])
+		return 0;
+	return s[0] << 16 | s[1] << 8 | s[2];
+}
+
+static void index_entry(struct tinyrl_history *history, const struct entry *entry)
+{
+	struct postings *p;
+	const char *text;
+	unsigned gram;
+	unsigned *ids;
+
+	for (text = entry->text; (gram = index_gram(text)); text++) {
+		p = index_find(history, gram, true);
+		if (!p)
+			continue;
+		/* an entry is only listed once for each trigram */
+		if (p->count && p->ids[p->count - 1] == entry->id)
+			continue;
+		if (p->count == p->size) {
+			ids = realloc(p->ids, sizeof(*ids) * (p->size * 2 + 4));
+			if (!ids)
+				continue;
+			p->ids = ids;
+			p->size = p->size * 2 + 4;
+		}
+		p->ids[p->count++] = entry->id;
+		history->postings++;
+	}
+}
+
+/* number the entries from 0 again, dropping the indexes of the old ids */
+static void renumber(struct tinyrl_history *history)
+{
+	unsigned i;
+
+	index_free(history);
+	sorted_free(history);
+	for (i = 0; i < history->length; i++)
+		history->entries[slot(history, i)].id = i;
+	history->next_id = history->length;
+}
+
+static void index_build(struct tinyrl_history *history)
+{
+	unsigned i;
+
+	renumber(history);
+	for (i = 0; i < history->length; i++)
+		index_entry(history, &history->entries[slot(history, i)]);
+	history->indexed = true;
+}
+
+/* number and index an entry which has just been added to the end */
+static void index_add(struct tinyrl_history *history, struct entry *entry)
+{
+	if (history->next_id == UINT_MAX)
+		renumber(history);
+	entry->id = history->next_id++;
+	if (history->indexed)
+		index_entry(history, entry);
+	if (history->sorted_valid)
+		sorted_insert(history, entry);
+	history->matched = false;
+}
+
+static void index_remove(struct tinyrl_history *history, const struct entry *entry)
+{
+	size_t len;
+
+	if (history->indexed) {
+		len = strlen(entry->text);
+		if (len > 2)
+			history->stale += len - 2;
+	}
+	if (history->sorted_valid)
+		sorted_remove(history, entry);
+	history->matched = false;
+}
+
+/* the position of the entry with an id, or the length if it is gone */
+static unsigned index_position(const struct tinyrl_history *history, unsigned id)
+{
+	unsigned lo = 0, hi = history->length, mid, found;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		found = history->entries[slot(history, mid)].id;
+		if (found == id)
+			return mid;
+		if (found < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return history->length;
+}
+
+/*
+ * Find the newest entry before position which contains the query, or
+ * return the length if there is none.  Only the entries listed for the
+ * query's rarest trigram are checked, so a longer query checks fewer.
+ */
+static unsigned search(struct tinyrl_history *history,
+		       const char *query, unsigned position)
+{
+	const struct postings *p, *rarest = NULL;
+	const char *text;
+	unsigned gram, id, lo, hi, mid;
+
+	if (!index_gram(query) || !history->indexed) {
+		/* too short to index, but also likely to match soon */
+		while (position-- > 0)
+			if (strstr(history->entries[slot(history, position)].text, query))
+				return position;
+		return history->length;
+	}
+
+	for (text = query; (gram = index_gram(text)); text++) {
+		p = index_find(history, gram, false);
+		if (!p)
+			return history->length;
+		if (!rarest || p->count < rarest->count)
+			rarest = p;
+	}
+
+	/* the ids before the entry at position */
+	id = position < history->length
+		? history->entries[slot(history, position)].id : history->next_id;
+	lo = 0;
+	hi = rarest->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rarest->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	while (lo-- > 0) {
+		position = index_position(history, rarest->ids[lo]);
+		if (position < history->length
+		    && strstr(history->entries[slot(history, position)].text, query))
+			return position;
+	}
+	return history->length;
+}
+
+static int match_compare(const void *a, const void *b)
+{
+	const struct prefix_match *x = a, *y = b;
+
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+/* add a match at index count, growing the array if necessary */
+static bool prefix_match_add(struct tinyrl_history *history, unsigned count,
+			     const char *text, unsigned id)
+{
+	struct prefix_match *matches;
+
+	if (count == history->matches_size) {
+		matches = realloc(history->matches, sizeof(*matches)
+				  * (history->matches_size * 2 + 16));
+		if (!matches)
+			return false;
+		history->matches = matches;
+		history->matches_size = history->matches_size * 2 + 16;
+	}
+	history->matches[count].text = text;
+	history->matches[count].id = id;
+	return true;
+}
+
+/*
+ * Find the entries which start with the prefix, and put them in order.
+ * A few are found from the range of the sorted entries and then sorted,
+ * but if there are many it is quicker to look through all the entries.
+ */
+static void prefix_match_build(struct tinyrl_history *history)
+{
+	struct prefix_match *matches;
+	const struct sorted_entry *sorted;
+	const struct entry *entry;
+	struct sorted_pos i;
+	unsigned count = 0, older, newer, j;
+
+	history->matches_count = 0;
+	if (!history->sorted_valid)
+		sorted_build(history);
+	if (!history->sorted_valid)
+		return;
+
+	for (i = sorted_search(history, history->prefix, 0);
+	     i.block < history->sorted_blocks; sorted_next(history, &i)) {
+		sorted = sorted_at(history, i);
+		if (strncmp(sorted->text, history->prefix, history->prefix_len) != 0)
+			break;
+		if (count > history->length / 8)
+			break;
+		if (!prefix_match_add(history, count++, sorted->text, sorted->id))
+			return;
+	}
+
+	if (count > history->length / 8) {
+		for (count = 0, j = 0; j < history->length; j++) {
+			entry = &history->entries[slot(history, j)];
+			if (strncmp(entry->text, history->prefix,
+				    history->prefix_len) == 0
+			    && !prefix_match_add(history, count++,
+						 entry->text, entry->id))
+				return;
+		}
+	} else if (count) {
+		qsort(history->matches, count, sizeof(*history->matches),
+		      match_compare);
+	}
+	matches = history->matches;
+
+	/* link each run of the same text to the entries either side of it */
+	for (older = UINT_MAX, j = 0; j < count; j++) {
+		if (j && strcmp(matches[j].text, matches[j - 1].text) != 0)
+			older = j - 1;
+		matches[j].older = older;
+	}
+	for (newer = UINT_MAX, j = count; j-- > 0;) {
+		if (j + 1 < count && strcmp(matches[j].text, matches[j + 1].text) != 0)
+			newer = j + 1;
+		matches[j].newer = newer;
+	}
+
+	history->matches_count = count;
+	history->matched = true;
+}
+
+/*
+ * Find the nearest entry before position, or after it if newer, which
+ * starts with the prefix and isn't the same as the line, or return the
+ * length if there is none.  The entries with the prefix are found once,
+ * and after that each key only needs a binary search.
+ */
+static unsigned prefix_search(struct tinyrl_history *history,
+			      unsigned position, bool newer)
+{
+	const char *line = tinyrl_get_line(history->tinyrl);
+	const struct prefix_match *matches;
+	unsigned id, lo, hi, mid, found;
+
+	if (!history->matched)
+		prefix_match_build(history);
+	matches = history->matches;
+
+	/* the first match after the entry at position */
+	id = position < history->length
+		? history->entries[slot(history, position)].id : history->next_id;
+	lo = 0;
+	hi = history->matches_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (matches[mid].id <= id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (newer) {
+		found = lo < history->matches_count ? lo : UINT_MAX;
+	} else {
+		if (lo && matches[lo - 1].id == id)
+			lo--;
+		found = lo ? lo - 1 : UINT_MAX;
+	}
+
+	/* skip past the entries which are the same as the line */
+	if (found != UINT_MAX && strcmp(matches[found].text, line) == 0)
+		found = newer ? matches[found].newer : matches[found].older;
+
+	return found != UINT_MAX ? index_position(history, matches[found].id)
+		: history->length;
+}
+
 static bool tinyrl_history_key_up(void *context, char *key)
 {
 	struct tinyrl_history *history = context;
+	const char *line = tinyrl_get_line(history->tinyrl);
+	unsigned point = tinyrl_get_point(history->tinyrl);
+	unsigned position;
+	char *prefix;
 
-	if (tinyrl_history_get(history, history->iter) != tinyrl_get_line(history->tinyrl))
+	if (tinyrl_history_get(history, history->iter) != line) {
 		history->iter = tinyrl_history_length(history);
-	if (history->iter == 0)
-		return false;
-	history->iter--;
+
+		/* keep the text before the cursor to look for */
+		history->prefix_len = 0;
+		if (history->prefix_search && point) {
+			if (point >= history->prefix_size) {
+				prefix = realloc(history->prefix, point + 1);
+				if (!prefix)
+					return false;
+				history->prefix = prefix;
+				history->prefix_size = point + 1;
+			}
+			memcpy(history->prefix, line, point);
+			history->prefix[point] = '\0';
+			history->prefix_len = point;
+			history->matched = false;
+		}
+	}
+
+	if (history->prefix_len) {
+		position = prefix_search(history, history->iter, false);
+		if (position == history->length)
+			return false;
+	} else {
+		if (history->iter == 0)
+			return false;
+		position = history->iter - 1;
+	}
+	history->iter = position;
 	tinyrl_set_line(history->tinyrl, tinyrl_history_get(history, history->iter));
+	if (history->prefix_len)
+		tinyrl_set_point(history->tinyrl, history->prefix_len);
 	return true;
 }
 
@@ -40,8 +740,129 @@ static bool tinyrl_history_key_down(void *context, char *key)
 
 	if (tinyrl_history_get(history, history->iter) != tinyrl_get_line(history->tinyrl))
 		return false;
-	history->iter++;
+	if (history->prefix_len)
+		history->iter = prefix_search(history, history->iter, true);
+	else
+		history->iter++;
 	tinyrl_set_line(history->tinyrl, tinyrl_history_get(history, history->iter));
+	if (history->prefix_len)
+		tinyrl_set_point(history->tinyrl, history->prefix_len);
+	return true;
+}
+
+/* show the query in the prompt, and the line it matches */
+static void search_show(struct tinyrl_history *history, bool found)
+{
+	char *prompt;
+
+	prompt = realloc(history->search_prompt, history->query_len + 32);
+	if (!prompt)
+		return;
+	sprintf(prompt, "(%sreverse-i-search)`%.*s': ", found ? "" : "failed ",
+		(int)history->query_len, history->query);
+	history->search_prompt = prompt;
+	tinyrl_set_prompt(history->tinyrl, prompt);
+
+	if (!found)
+		tinyrl_ding(history->tinyrl);
+	else if (history->match < history->length)
+		tinyrl_set_line(history->tinyrl,
+				tinyrl_history_get(history, history->match));
+}
+
+/* look for the query in the entries before position */
+static void search_from(struct tinyrl_history *history, unsigned position)
+{
+	unsigned match = history->length;
+
+	if (history->query_len)
+		match = search(history, history->query, position);
+	if (match < history->length)
+		history->match = match;
+	search_show(history, match < history->length || !history->query_len);
+}
+
+static void search_end(struct tinyrl_history *history)
+{
+	tinyrl_set_prompt(history->tinyrl, history->prompt);
+	tinyrl_grab_keys(history->tinyrl, NULL, NULL);
+
+	/* carry on through the whole history from the match */
+	if (history->match < history->length)
+		history->iter = history->match;
+	history->prefix_len = 0;
+}
+
+/* every key comes here while searching */
+static bool tinyrl_history_key_searching(void *context, char *key)
+{
+	struct tinyrl_history *history = context;
+	unsigned char c = key[0];
+	size_t len;
+	char *query;
+
+	if (c == CTRL('R')) {
+		/* look further back for the same query */
+		if (history->query_len)
+			search_from(history, history->match);
+		return true;
+	}
+
+	if (c == CTRL('G')) {
+		/* give up, and go back to the line being edited */
+		history->match = history->length;
+		search_end(history);
+		tinyrl_set_line(history->tinyrl, history->line);
+		return true;
+	}
+
+	if (c == 127 || c == CTRL('H')) {
+		/* drop the last character, and search again from the newest */
+		if (!history->query_len)
+			return true;
+		while (--history->query_len
+		       && (history->query[history->query_len] & 0xc0) == 0x80)
+			;
+		history->query[history->query_len] = '\0';
+		search_from(history, history->length);
+		return true;
+	}
+
+	if (c < ' ') {
+		/* any other key takes the match and is then handled */
+		search_end(history);
+		return false;
+	}
+
+	/* add to the query, which the match may still contain */
+	len = strlen(key);
+	if (history->query_len + len >= history->query_size) {
+		query = realloc(history->query, history->query_len + len + 32);
+		if (!query)
+			return false;
+		history->query = query;
+		history->query_size = history->query_len + len + 32;
+	}
+	memcpy(history->query + history->query_len, key, len + 1);
+	history->query_len += len;
+	search_from(history, history->match < history->length
+		    ? history->match + 1 : history->length);
+	return true;
+}
+
+static bool tinyrl_history_key_search(void *context, char *key)
+{
+	struct tinyrl_history *history = context;
+
+	if (!history->indexed)
+		index_build(history);
+
+	history->prompt = tinyrl_get_prompt(history->tinyrl);
+	history->line = tinyrl_get_line(history->tinyrl);
+	history->query_len = 0;
+	history->match = history->length;
+	search_show(history, true);
+	tinyrl_grab_keys(history->tinyrl, tinyrl_history_key_searching, history);
 	return true;
 }
 
@@ -55,29 +876,122 @@ struct tinyrl_history *tinyrl_history_new(struct tinyrl *tinyrl, unsigned limit)
 
 	history->tinyrl = tinyrl;
 	history->entries = NULL;
+	history->chunk = NULL;
+	history->first = 0;
 	history->limit = limit;
 	history->length = 0;
 	history->size = 0;
 	history->iter = 0;
+	history->fd = -1;
+	history->grams = NULL;
+	history->grams_size = 0;
+	history->grams_used = 0;
+	history->postings = 0;
+	history->stale = 0;
+	history->next_id = 0;
+	history->indexed = false;
+	history->sorted = NULL;
+	history->sorted_blocks = 0;
+	history->sorted_size = 0;
+	history->sorted_valid = false;
+	history->prefix_search = false;
+	history->prefix = NULL;
+	history->prefix_len = 0;
+	history->prefix_size = 0;
+	history->matches = NULL;
+	history->matches_count = 0;
+	history->matches_size = 0;
+	history->matched = false;
+	history->prompt = NULL;
+	history->line = NULL;
+	history->search_prompt = NULL;
+	history->query = NULL;
+	history->query_len = 0;
+	history->query_size = 0;
+	history->match = 0;
 
 	tinyrl_bind_special(tinyrl, TINYRL_KEY_UP, tinyrl_history_key_up, history);
 	tinyrl_bind_special(tinyrl, TINYRL_KEY_DOWN, tinyrl_history_key_down, history);
+	tinyrl_bind_key(tinyrl, CTRL('R'), tinyrl_history_key_search, history);
 	return history;
 }
 
+static void free_chunk(struct chunk *c)
+{
+	if (c->map)
+		munmap(c->map, c->size);
+	free(c);
+}
+
+/* copy a line into the current chunk, starting a new one when it is full */
+static const char *store(struct tinyrl_history *history, const char *line,
+			 struct chunk **chunk)
+{
+	struct chunk *c = history->chunk;
+	size_t len = strlen(line) + 1;
+	size_t size;
+	char *text;
+
+	if (c && !c->entries)
+		c->used = 0;
+	if (!c || c->size - c->used < len) {
+		size = CHUNK_SIZE - sizeof(*c);
+		if (size < len)
+			size = len;
+		c = malloc(sizeof(*c) + size);
+		if (!c)
+			return NULL;
+		c->entries = 0;
+		c->used = 0;
+		c->size = size;
+		c->map = NULL;
+		if (history->chunk && !history->chunk->entries)
+			free(history->chunk);
+		history->chunk = c;
+	}
+
+	text = memcpy(c->text + c->used, line, len);
+	c->used += len;
+	c->entries++;
+	*chunk = c;
+	return text;
+}
+
+/* free a chunk once none of its entries are left */
+static void put_chunk(struct tinyrl_history *history, struct chunk *c)
+{
+	if (!--c->entries && c != history->chunk)
+		free_chunk(c);
+}
+
+static void release(struct tinyrl_history *history, struct entry *entry)
+{
+	put_chunk(history, entry->chunk);
+}
+
 void tinyrl_history_delete(struct tinyrl_history *history)
 {
 	unsigned i;
 
 	for (i = 0; i < history->length; i++)
-		free(history->entries[i]);
+		release(history, &history->entries[slot(history, i)]);
+	free(history->chunk);
 	free(history->entries);
+	if (history->fd >= 0)
+		close(history->fd);
+	index_free(history);
+	sorted_free(history);
+	free(history->prefix);
+	free(history->matches);
+	free(history->search_prompt);
+	free(history->query);
 	free(history);
 }
 
 /*
  * This removes the specified entries from the 
- * entries vector. Shuffling up the array as necessary 
+ * entries vector.  The oldest entries are dropped by moving the start
+ * of the circle, otherwise the shorter side of the gap is shuffled up.
  */
 static void
 remove_entries(struct tinyrl_history *history, unsigned start, unsigned delta)
@@ -87,11 +1001,34 @@ remove_entries(struct tinyrl_history *history, unsigned start, unsigned delta)
 
 	assert(end <= history->length);
 
-	for (i = start; i < end; i++)
-		free(history->entries[i]);
-	memmove(history->entries + start, history->entries + end,
-		sizeof(*history->entries) * (history->length - end));
+	/* sorting again is quicker than removing many sorted entries */
+	if (delta > 1)
+		sorted_free(history);
+
+	for (i = start; i < end; i++) {
+		index_remove(history, &history->entries[slot(history, i)]);
+		release(history, &history->entries[slot(history, i)]);
+	}
+
+	if (start < history->length - end) {
+		/* move the entries before the gap forwards */
+		for (i = start; i-- > 0;)
+			history->entries[slot(history, i + delta)] =
+				history->entries[slot(history, i)];
+		history->first = slot(history, delta);
+	} else {
+		/* move the entries after the gap backwards */
+		for (i = end; i < history->length; i++)
+			history->entries[slot(history, i - delta)] =
+				history->entries[slot(history, i)];
+	}
 	history->length -= delta;
+	if (!history->length)
+		history->first = 0;
+
+	/* index again once most of the postings are stale */
+	if (history->stale > history->postings / 2)
+		index_free(history);
 }
 
 /* 
@@ -100,9 +1037,15 @@ remove_entries(struct tinyrl_history *history, unsigned start, unsigned delta)
    */
 static void append_entry(struct tinyrl_history *history, const char *line)
 {
+	struct entry *entry;
+
 	if (history->length < history->size) {
-		history->entries[history->length] = strdup(line);
-		history->length++;
+		entry = &history->entries[slot(history, history->length)];
+		entry->text = store(history, line, &entry->chunk);
+		if (entry->text) {
+			history->length++;
+			index_add(history, entry);
+		}
 	}
 }
 
@@ -110,13 +1053,23 @@ static void append_entry(struct tinyrl_history *history, const char *line)
 static void grow(struct tinyrl_history *history)
 {
 	if (history->size == history->length) {
-		/* increment the history memory by 10 entries each time we grow */
-		unsigned new_size = history->size + 10;
-		char **new_entries;
+		/* double the history memory each time we grow, up to the limit */
+		unsigned new_size = history->size * 2 + 16;
+		unsigned tail = history->size - history->first;
+		struct entry *new_entries;
 
+		if (history->limit && new_size > history->limit)
+			new_size = history->limit;
 		new_entries = realloc(history->entries,
 				      sizeof(*history->entries) * new_size);
 		if (NULL != new_entries) {
+			/* keep the wrapped tail at the end of the circle */
+			if (history->first) {
+				memmove(new_entries + new_size - tail,
+					new_entries + history->first,
+					sizeof(*new_entries) * tail);
+				history->first = new_size - tail;
+			}
 			history->size = new_size;
 			history->entries = new_entries;
 		}
@@ -125,6 +1078,16 @@ static void grow(struct tinyrl_history *history)
 
 void tinyrl_history_add(struct tinyrl_history *history, const char *line)
 {
+	size_t len = strlen(line) + 1;
+
+	/* a single write of the whole record, so that appends don't mix */
+	if (history->fd >= 0 &&
+	    write(history->fd, line, len) != (ssize_t)len) {
+		/* stop appending rather than leave part of a record */
+		close(history->fd);
+		history->fd = -1;
+	}
+
 	if (history->length && (history->length == history->limit)) {
 		/* remove the oldest entry */
 		remove_entries(history, 0, 1);
@@ -155,6 +1118,185 @@ void tinyrl_history_limit(struct tinyrl_history *history, unsigned limit)
 	history->limit = limit;
 }
 
+void tinyrl_history_enable_prefix_search(struct tinyrl_history *history)
+{
+	history->prefix_search = true;
+}
+
+void tinyrl_history_disable_prefix_search(struct tinyrl_history *history)
+{
+	history->prefix_search = false;
+	history->prefix_len = 0;
+	sorted_free(history);
+	free(history->matches);
+	history->matches = NULL;
+	history->matches_count = 0;
+	history->matches_size = 0;
+	history->matched = false;
+}
+
+/*
+   HISTORY FILES
+
+   Each record is a line followed by its terminating NUL, so that a
+   mapping of the file can be indexed in place.
+   */
+bool tinyrl_history_load(struct tinyrl_history *history, const char *path)
+{
+	struct chunk *c;
+	struct entry *entry;
+	struct stat st;
+	char *text;
+	char *end;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
+	if (!st.st_size) {
+		close(fd);
+		return true;
+	}
+
+	c = malloc(sizeof(*c));
+	if (!c) {
+		close(fd);
+		return false;
+	}
+	c->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (c->map == MAP_FAILED) {
+		free(c);
+		return false;
+	}
+	c->size = c->used = st.st_size;
+
+	/* sorting once is quicker than inserting each entry */
+	sorted_free(history);
+
+	/* hold the chunk while entries from it may be evicted */
+	c->entries = 1;
+
+	/* only the last records fit within the limit */
+	text = c->map;
+	if (history->limit) {
+		unsigned records = 0;
+		size_t i;
+
+		for (i = c->size; i > 0; i--)
+			if (!c->map[i - 1] && records++ == history->limit)
+				break;
+		text += i;
+	}
+
+	/* a record without its terminator is still being written */
+	for (; (end = memchr(text, '\0', c->map + c->size - text));
+	     text = end + 1) {
+		if (history->length && (history->length == history->limit))
+			remove_entries(history, 0, 1);
+		else
+			grow(history);
+		if (history->length == history->size)
+			break;
+		entry = &history->entries[slot(history, history->length)];
+		entry->text = text;
+		entry->chunk = c;
+		c->entries++;
+		history->length++;
+		index_add(history, entry);
+	}
+
+	put_chunk(history, c);
+	return true;
+}
+
+bool tinyrl_history_open(struct tinyrl_history *history, const char *path)
+{
+	struct stat st;
+	char last;
+	int fd;
+	int err;
+
+	fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return false;
+
+	/* end a record left unterminated by a failed write, before adding to it */
+	if (fstat(fd, &st) < 0
+	    || (st.st_size && (pread(fd, &last, 1, st.st_size - 1) != 1
+			       || (last && write(fd, "", 1) != 1)))) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return false;
+	}
+
+	if (history->fd >= 0)
+		close(history->fd);
+	history->fd = fd;
+	return true;
+}
+
+bool tinyrl_history_save(const struct tinyrl_history *history,
+			 const char *path)
+{
+	const char *text;
+	char *temp;
+	FILE *f;
+	int fd;
+	int err;
+	unsigned i;
+
+	temp = malloc(strlen(path) + sizeof(".XXXXXX"));
+	if (!temp)
+		return false;
+	sprintf(temp, "%s.XXXXXX", path);
+	fd = mkstemp(temp);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(temp);
+		}
+		free(temp);
+		return false;
+	}
+
+	for (i = 0; i < history->length; i++) {
+		text = history->entries[slot(history, i)].text;
+		if (fwrite(text, strlen(text) + 1, 1, f) != 1)
+			break;
+	}
+
+	/*
+	 * Replace the file in one step, once the new one is safely on disk,
+	 * so that it is never seen half written.  On failure the old file
+	 * is left alone.
+	 */
+	if (i < history->length || fflush(f) != 0 || ferror(f)
+	    || fsync(fileno(f)) < 0) {
+		err = errno;
+		fclose(f);
+		goto fail;
+	}
+	if (fclose(f) != 0 || rename(temp, path) < 0) {
+		err = errno;
+		goto fail;
+	}
+	free(temp);
+	return true;
+
+fail:
+	unlink(temp);
+	free(temp);
+	errno = err;
+	return false;
+}
+
 /*
    INFORMATION ABOUT THE HISTORY LIST 
    */
@@ -162,7 +1304,7 @@ const char *tinyrl_history_get(const struct tinyrl_history *history,
 			       unsigned position)
 {
 	if (position < history->length)
-		return history->entries[position];
+		return history->entries[slot(history, position)].text;
 	return NULL;
 }
 
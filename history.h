@@ -17,6 +17,16 @@
 
 struct tinyrl;
 
+/**
+ * Create a history which the Up and Down keys move through, and which
+ * Ctrl-R searches incrementally.  While searching, typed characters are
+ * added to the text searched for, Ctrl-R looks for older matches, and
+ * Ctrl-G goes back to the line being edited.  Any other key takes the
+ * match and is then handled as usual.
+ *
+ * The search uses an index of the entries, built for the first search,
+ * so each key only checks the entries which may match.
+ */
 struct tinyrl_history *tinyrl_history_new(struct tinyrl *tinyrl, unsigned limit);
 
 void tinyrl_history_delete(struct tinyrl_history *history);
@@ -29,6 +39,64 @@ void tinyrl_history_remove(struct tinyrl_history *history, unsigned offset);
 void tinyrl_history_clear(struct tinyrl_history *history);
 void tinyrl_history_limit(struct tinyrl_history *history, unsigned limit);
 
+/**
+ * Make Up and Down only go to entries which start with the text before
+ * the cursor, leaving the cursor after it.  With the cursor at the
+ * start of the line they go through every entry as usual.
+ *
+ * The entries are kept sorted once this is first used, so only those
+ * with the prefix are looked at.  They are put in order for the first
+ * Up, after which each key only takes a binary search.
+ */
+void tinyrl_history_enable_prefix_search(struct tinyrl_history *history);
+
+/**
+ * Make Up and Down go through every entry. (This is the default behaviour)
+ */
+void tinyrl_history_disable_prefix_search(struct tinyrl_history *history);
+
+/*
+   HISTORY FILES 
+   */
+
+/**
+ * Add the lines of a history file to the history.
+ *
+ * The file is mapped, and the entries point into the mapping rather than
+ * being copied, so loading a large history is quick.  A record which is
+ * still being written by another process is ignored.
+ *
+ * \return false, with errno set, if the file couldn't be read
+ */
+bool tinyrl_history_load(struct tinyrl_history *history, const char *path);
+
+/**
+ * Append each line which is added from now on to a history file.
+ *
+ * Each line is added with a single write() in append mode, so several
+ * processes can share the file without mixing up their lines.  The file
+ * is a log, and grows beyond the history limit until it is saved.
+ * A record left unterminated at the end of the file by a failed write
+ * is ended first, so that the next line doesn't join on to it.
+ *
+ * \return false, with errno set, if the file couldn't be opened
+ */
+bool tinyrl_history_open(struct tinyrl_history *history, const char *path);
+
+/**
+ * Replace a history file with the lines currently in the history.
+ *
+ * The file is written under a temporary name, synced, and renamed into
+ * place, so the old file is kept if anything goes wrong.
+ * Lines appended to the old file from then on are lost, including by
+ * tinyrl_history_open(), so compact a file by loading and saving it
+ * before it is opened for appending.
+ *
+ * \return false, with errno set, if the file couldn't be written
+ */
+bool tinyrl_history_save(const struct tinyrl_history *history,
+			 const char *path);
+
 const char *tinyrl_history_get(const struct tinyrl_history *history,
 				      unsigned offset);
 size_t tinyrl_history_length(const struct tinyrl_history *history);
@@ -0,0 +1,273 @@
+/*
+ * linebench.c
+ *
+ * Benchmark for reading megabyte sized lines.  Each size is read once
+ * as a bracketed paste fed in 4KB blocks, and once typed in 64 byte
+ * bursts, and the realloc() calls made by the library, the bytes they
+ * had to copy and the time taken are reported.
+ *
+ * A script of that size, which ends in a megabyte line without a
+ * newline, is then read both from a regular file and through a pipe,
+ * with the line length limited.  The resident memory after reading it
+ * is reported, and each way must return every line.
+ *
+ * It is linked with --wrap=realloc, so that the library's calls come
+ * through here to be counted.  Each buffer must grow in a number of
+ * steps that is logarithmic in how much it grew, and every line must be
+ * read whole, or the benchmark fails.
+ *
+ * usage: linebench [megabytes...]
+ */
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tinyrl.h"
+
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+#define GROWTHS 64
+
+/* the reallocs which grew a buffer in turn */
+static struct growth {
+	void *ptr;
+	size_t first;
+	size_t last;
+	unsigned count;
+} growths[GROWTHS];
+
+static unsigned long reallocs;
+static unsigned long long copied;
+static bool failed;
+
+static struct growth *growth_find(void *ptr, size_t old, size_t size)
+{
+	struct growth *g, *free_slot = NULL;
+
+	for (g = growths; g < growths + GROWTHS; g++) {
+		if (ptr && g->ptr == ptr && size > g->last)
+			return g;
+		if (g->ptr == ptr || (!free_slot && !g->count))
+			free_slot = g;
+	}
+	if (!free_slot)
+		return NULL;
+
+	/* shrinking, or a buffer not seen before, starts again */
+	free_slot->ptr = ptr;
+	free_slot->first = old ? old : size;
+	free_slot->last = size;
+	free_slot->count = 0;
+	return free_slot;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	size_t old = ptr ? malloc_usable_size(ptr) : 0;
+	struct growth *g;
+	void *result;
+
+	reallocs++;
+	result = __real_realloc(ptr, size);
+	if (result && ptr && result != ptr)
+		copied += old < size ? old : size;
+
+	g = growth_find(ptr, old, size);
+	if (g && result) {
+		g->ptr = result;
+		g->last = size;
+		g->count++;
+	}
+	return result;
+}
+
+static void growth_reset(void)
+{
+	memset(growths, 0, sizeof(growths));
+	reallocs = 0;
+	copied = 0;
+}
+
+/*
+ * Check that no buffer took more than about log2(last / first) steps
+ * to grow.  Returns a note for the report, empty if all is well.
+ */
+static const char *growth_check(void)
+{
+	const struct growth *g;
+	unsigned bound;
+
+	for (g = growths; g < growths + GROWTHS; g++) {
+		for (bound = 0; (g->first << bound) < g->last; bound++)
+			;
+		if (g->count > bound + 2) {
+			failed = true;
+			return " (too many reallocs)";
+		}
+	}
+	return "";
+}
+
+static const char *line_check(bool whole)
+{
+	if (whole)
+		return "";
+	failed = true;
+	return " (line lost)";
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void drain(struct tinyrl *t)
+{
+	size_t len;
+
+	tinyrl_output(t, &len);
+	tinyrl_output_consume(t, len);
+}
+
+/* read one line of size bytes, fed in blocks of block bytes */
+static void run(const char *name, size_t size, size_t block, bool paste)
+{
+	struct tinyrl *t = tinyrl_session_new();
+	const char *line;
+	char *text;
+	size_t i, n, len;
+	double start;
+
+	text = malloc(block);
+	memset(text, 'x', block);
+	tinyrl_set_width(t, 80);
+	if (paste)
+		tinyrl_enable_bracketed_paste(t);
+	tinyrl_feed_start(t, "> ");
+	drain(t);
+
+	growth_reset();
+	start = now_ms();
+	if (paste)
+		tinyrl_feed(t, "\x1b[200~", 6);
+	for (i = 0; i < size; i += n) {
+		n = size - i < block ? size - i : block;
+		tinyrl_feed(t, text, n);
+		drain(t);
+	}
+	if (paste)
+		tinyrl_feed(t, "\x1b[201~", 6);
+	tinyrl_feed(t, "\r", 1);
+	drain(t);
+	line = tinyrl_feed_line_view(t, &len);
+
+	printf("%-6s %5zuMB: %4lu reallocs, %8.1fMB copied, %8.1fms%s%s\n",
+	       name, size >> 20, reallocs, copied / 1048576.0, now_ms() - start,
+	       growth_check(), line_check(line && len == size));
+
+	tinyrl_delete(t);
+	free(text);
+}
+
+static long rss_kb(void)
+{
+	char buf[128];
+	long kb = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		return 0;
+	while (fgets(buf, sizeof(buf), f))
+		if (sscanf(buf, "VmRSS: %ld", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+/* write a script of size bytes of short lines, then a megabyte line */
+static void make_script(const char *path, size_t size)
+{
+	static const char line[] = "echo a line of the script, which is read\n";
+	FILE *f = fopen(path, "w");
+	size_t i;
+
+	for (i = 0; i < size; i += sizeof(line) - 1)
+		fputs(line, f);
+	for (i = 0; i < 1 << 20; i++)
+		putc('x', f);
+	fclose(f);
+}
+
+/* read every line of the script, which ends in the megabyte line */
+static void script(const char *name, const char *path, size_t size)
+{
+	struct tinyrl *t;
+	const char *line;
+	char command[64];
+	size_t lines = 0, len = 0, last = 0;
+	double start;
+	FILE *f;
+
+	snprintf(command, sizeof(command), "cat %s", path);
+	f = strcmp(name, "pipe") == 0 ? popen(command, "r") : fopen(path, "r");
+	t = tinyrl_new(f, NULL);
+	tinyrl_disable_script_echo(t);
+	tinyrl_limit_line_length(t, 4096);
+
+	start = now_ms();
+	while ((line = tinyrl_readline_view(t, "> ", &len))) {
+		last = len;
+		lines++;
+	}
+
+	printf("%-6s %5zuMB: %8zu lines, %8ldkB resident, %8.1fms%s\n",
+	       name, size >> 20, lines, rss_kb(), now_ms() - start,
+	       line_check(last == 1 << 20));
+
+	tinyrl_delete(t);
+	if (strcmp(name, "pipe") == 0)
+		pclose(f);
+	else
+		fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	char path[] = "/tmp/linebench.XXXXXX";
+	size_t size;
+	int fd;
+
+	static const char *defaults[] = { "1", "4", "16" };
+	const char **sizes = defaults;
+	int count = 3;
+	int i;
+
+	if (argc > 1) {
+		sizes = (const char **)argv + 1;
+		count = argc - 1;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	for (i = 0; i < count; i++) {
+		size = (size_t)atoi(sizes[i]) << 20;
+		run("paste", size, 4096, true);
+		run("typed", size, 64, false);
+		make_script(path, size);
+		script("file", path, size);
+		script("pipe", path, size);
+	}
+
+	unlink(path);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * loadgen.c
+ *
+ * Load generator for the example server.  Each connection simulates a
+ * typist entering commands one key at a time, and the time from sending
+ * a key to receiving its echo is recorded.  At the end the latency
+ * percentiles and the server's memory use per session are reported.
+ *
+ * usage: loadgen [-s socket] [-n sessions] [-d seconds] [-i interval_ms]
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char command[] = "show interfaces brief\r";
+
+struct typist {
+	int fd;
+	size_t pos;
+	long long next_key;
+	long long sent_at;
+};
+
+static long long *samples;
+static size_t nsamples, samples_size;
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int connect_to(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(path);
+		exit(1);
+	}
+	return fd;
+}
+
+/* discard whatever the server has sent so far */
+static ssize_t drain(int fd, char *buf, size_t size)
+{
+	ssize_t n, total = 0;
+
+	while ((n = recv(fd, buf, size, MSG_DONTWAIT)) > 0)
+		total += n;
+	return total;
+}
+
+/* ask the server for its memory use */
+static long server_rss(int fd)
+{
+	char buf[4096], *p;
+	size_t len = 0;
+	ssize_t n;
+	long rss;
+
+	drain(fd, buf, sizeof(buf));
+	write(fd, "stats\r", 6);
+	for (;;) {
+		n = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (n <= 0)
+			return 0;
+		len += n;
+		buf[len] = 0;
+		p = strstr(buf, "rss ");
+		if (p && strstr(p, "kB"))
+			break;
+	}
+	sscanf(p, "rss %ld", &rss);
+	return rss;
+}
+
+static int compare(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void record(long long latency)
+{
+	if (nsamples == samples_size) {
+		samples_size = samples_size ? samples_size * 2 : 4096;
+		samples = realloc(samples, samples_size * sizeof(*samples));
+	}
+	samples[nsamples++] = latency;
+}
+
+static void report(void)
+{
+	static const double percentiles[] = { 50, 90, 99, 99.9, 100 };
+	size_t i, k;
+
+	qsort(samples, nsamples, sizeof(*samples), compare);
+	printf("%zu keystrokes\n", nsamples);
+	if (!nsamples)
+		return;
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		k = (size_t)(percentiles[i] / 100 * (nsamples - 1));
+		printf("p%-5g %8.3f ms\n", percentiles[i], samples[k] / 1000.0);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = "/tmp/tinyrl.sock";
+	unsigned count = 100, duration = 10, interval = 100;
+	struct epoll_event events[256];
+	struct typist *typists, *t;
+	struct rlimit rl;
+	long long now, end, next;
+	long base, rss;
+	char buf[4096];
+	int epfd, ctl, n, i, opt, timeout;
+	unsigned j;
+
+	while ((opt = getopt(argc, argv, "s:n:d:i:")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s socket] [-n sessions] [-d seconds] [-i interval_ms]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	ctl = connect_to(path);
+	base = server_rss(ctl);
+
+	epfd = epoll_create1(0);
+	typists = calloc(count, sizeof(*typists));
+	now = now_us();
+	for (j = 0; j < count; j++) {
+		struct epoll_event ev;
+
+		t = &typists[j];
+		t->fd = connect_to(path);
+		/* spread the typists out over the first interval */
+		t->next_key = now + (long long)interval * 1000 * j / count;
+		ev.events = EPOLLIN;
+		ev.data.ptr = t;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, t->fd, &ev);
+	}
+
+	rss = server_rss(ctl);
+	printf("%u sessions, server rss %ld kB, %.1f kB per session\n",
+	       count, rss, count ? (double)(rss - base) / count : 0.0);
+
+	end = now_us() + duration * 1000000LL;
+	while ((now = now_us()) < end) {
+		/* send the keys that are due */
+		next = end;
+		for (j = 0; j < count; j++) {
+			t = &typists[j];
+			if (!t->sent_at && t->next_key <= now) {
+				t->sent_at = now;
+				write(t->fd, &command[t->pos], 1);
+				t->pos = (t->pos + 1) % (sizeof(command) - 1);
+			}
+			if (!t->sent_at && t->next_key < next)
+				next = t->next_key;
+		}
+
+		timeout = next > now ? (next - now + 999) / 1000 : 0;
+		n = epoll_wait(epfd, events, 256, timeout);
+		now = now_us();
+		for (i = 0; i < n; i++) {
+			t = events[i].data.ptr;
+			if (drain(t->fd, buf, sizeof(buf)) <= 0)
+				continue;
+			if (t->sent_at) {
+				record(now - t->sent_at);
+				t->sent_at = 0;
+				t->next_key = now + interval * 1000LL;
+			}
+		}
+	}
+
+	report();
+
+	rss = server_rss(ctl);
+	printf("server rss %ld kB, %.1f kB per session\n",
+	       rss, count ? (double)(rss - base) / count : 0.0);
+
+	for (j = 0; j < count; j++)
+		close(typists[j].fd);
+	close(ctl);
+	free(typists);
+	free(samples);
+	return 0;
+}
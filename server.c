@@ -0,0 +1,291 @@
+/*
+ * server.c
+ *
+ * A CLI server which runs an independent tinyrl session for each
+ * connection to a unix socket, all driven from a single epoll loop.
+ *
+ * Commands:
+ *   exit   close the connection
+ *   stats  report the number of sessions and the memory they use
+ *   other  echoed back
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "tinyrl.h"
+#include "history.h"
+
+#define ESCAPE_TIMEOUT 100
+
+struct session {
+	int fd;
+	struct tinyrl *t;
+	struct tinyrl_history *history;
+	bool writing;
+
+	/* sessions which may be holding part of an escape sequence */
+	long last_input;
+	struct session *prev;
+	struct session *next;
+};
+
+static int epfd;
+static unsigned sessions;
+static long base_rss;
+static struct session *pending_head;
+static struct session *pending_tail;
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long rss_kb(void)
+{
+	char line[128];
+	long rss = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+			break;
+	fclose(f);
+	return rss;
+}
+
+static void pending_remove(struct session *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else if (pending_head == s)
+		pending_head = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	else if (pending_tail == s)
+		pending_tail = s->prev;
+	s->prev = s->next = NULL;
+}
+
+static void pending_append(struct session *s)
+{
+	pending_remove(s);
+	s->last_input = now_ms();
+	s->prev = pending_tail;
+	if (pending_tail)
+		pending_tail->next = s;
+	else
+		pending_head = s;
+	pending_tail = s;
+}
+
+static void session_close(struct session *s)
+{
+	pending_remove(s);
+	close(s->fd);
+	tinyrl_history_delete(s->history);
+	tinyrl_delete(s->t);
+	free(s);
+	sessions--;
+}
+
+/* returns false if the connection failed */
+static bool session_flush(struct session *s)
+{
+	const char *out;
+	size_t len;
+	ssize_t n;
+	struct epoll_event ev;
+	bool writing;
+
+	out = tinyrl_output(s->t, &len);
+	while (len) {
+		n = write(s->fd, out, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return false;
+			break;
+		}
+		tinyrl_output_consume(s->t, n);
+		out = tinyrl_output(s->t, &len);
+	}
+
+	/* only ask for writability while output is backed up */
+	writing = len != 0;
+	if (writing != s->writing) {
+		ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+		ev.data.ptr = s;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+		s->writing = writing;
+	}
+	return true;
+}
+
+/* returns false if the session has ended */
+static bool session_status(struct session *s, int status)
+{
+	const char *line;
+	size_t len;
+
+	while (status & TINYRL_FEED_LINE) {
+		line = tinyrl_feed_line_view(s->t, &len);
+		if (strcmp(line, "exit") == 0)
+			return false;
+		if (strcmp(line, "stats") == 0) {
+			struct tinyrl_output_stats stats;
+			long rss = rss_kb();
+
+			tinyrl_printf(s->t, "sessions %u rss %ld kB (%ld kB per session)\n",
+				      sessions, rss, (rss - base_rss) / sessions);
+			tinyrl_get_output_stats(s->t, &stats);
+			tinyrl_printf(s->t, "this session: %llu bytes in %llu frames\n",
+				      stats.bytes, stats.frames);
+		} else if (*line) {
+			tinyrl_printf(s->t, "echo: %s\n", line);
+			tinyrl_history_add(s->history, line);
+		}
+		status = tinyrl_feed_start(s->t, "> ");
+	}
+
+	if (status & TINYRL_FEED_EOF)
+		return false;
+
+	return session_flush(s);
+}
+
+static void session_accept(int lfd)
+{
+	struct epoll_event ev;
+	struct session *s;
+	int fd;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		s = calloc(1, sizeof(*s));
+		s->fd = fd;
+		s->t = tinyrl_session_new();
+		s->history = tinyrl_history_new(s->t, 100);
+		sessions++;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = s;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+		if (!session_status(s, tinyrl_feed_start(s->t, "> ")))
+			session_close(s);
+	}
+}
+
+static void session_input(struct session *s)
+{
+	char buf[4096];
+	ssize_t n;
+	int status;
+
+	for (;;) {
+		n = read(s->fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n < 0)
+			n = 0;
+
+		status = tinyrl_feed(s->t, buf, n);
+		if (!session_status(s, status)) {
+			session_close(s);
+			return;
+		}
+		if (n == 0)
+			return;
+	}
+
+	pending_append(s);
+}
+
+/* finish any escape sequence which has been waiting too long */
+static int expire_escapes(void)
+{
+	struct session *s;
+	long now = now_ms();
+
+	while ((s = pending_head)) {
+		if (s->last_input + ESCAPE_TIMEOUT > now)
+			return s->last_input + ESCAPE_TIMEOUT - now;
+		pending_remove(s);
+		if (!session_status(s, tinyrl_feed_timeout(s->t)))
+			session_close(s);
+	}
+
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "/tmp/tinyrl.sock";
+	struct epoll_event events[64];
+	struct sockaddr_un addr;
+	struct rlimit rl;
+	int lfd, n, i, timeout;
+
+	/* allow as many connections as possible */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(lfd, SOMAXCONN) < 0) {
+		perror(path);
+		return 1;
+	}
+
+	epfd = epoll_create1(0);
+	events[0].events = EPOLLIN;
+	events[0].data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &events[0]);
+
+	base_rss = rss_kb();
+
+	for (;;) {
+		timeout = expire_escapes();
+		n = epoll_wait(epfd, events, 64, timeout);
+		for (i = 0; i < n; i++) {
+			struct session *s = events[i].data.ptr;
+
+			if (!s) {
+				session_accept(lfd);
+				continue;
+			}
+			if (events[i].events & EPOLLOUT && !session_flush(s)) {
+				session_close(s);
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				session_input(s);
+		}
+	}
+
+	return 0;
+}
@@ -3,22 +3,76 @@
 
 #include <assert.h>
 #include <ctype.h>
-#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define KEYMAP_SIZE 256
+#define INPUT_SIZE 1024
+#define KEY_SIZE 32
+#define ESCAPE_TIMEOUT 100
+#define SCRIPT_RELEASE (1024 * 1024)
+#define SCRIPT_BLOCK (64 * 1024)
 
+struct tinyrl_keymap_entry {
+	tinyrl_key_func_t *handler;
+	void *context;
+	struct tinyrl_keymap *keymap;
+};
+
+/*
+ * The keys which may follow a key sequence prefix.  These are few, so
+ * they are kept sparse and sorted by key.  The first key of a sequence
+ * is looked up directly in a dense table, which is the table of default
+ * bindings until the instance first changes one of them.
+ * Shared keymaps belong to the default bindings, and are copied by an
+ * instance before it changes them.
+ */
 struct tinyrl_keymap {
-	tinyrl_key_func_t *handler[KEYMAP_SIZE];
-	struct tinyrl_keymap *keymap[KEYMAP_SIZE];
-	void *context[KEYMAP_SIZE];
+	bool shared;
+	unsigned count;
+	struct tinyrl_keymap_key {
+		unsigned char key;
+		struct tinyrl_keymap_entry entry;
+	} *keys;
+};
+
+/* a grapheme, with any zero width characters that follow it */
+struct tinyrl_cell {
+	unsigned offset;
+	unsigned len;
+	unsigned row;
+	unsigned short col;
+	unsigned short width;
+};
+
+/*
+ * The prompt and line, laid out in rows of cells.  The text and cells
+ * may only be kept from offset base onwards.
+ */
+struct tinyrl_frame {
+	char *text;
+	size_t base;
+	size_t len;
+	size_t text_size;
+	struct tinyrl_cell *cells;
+	size_t count;
+	size_t cells_size;
+	size_t width;
+	size_t rows;
+	size_t point_row;
+	size_t point_col;
 };
 
 /* define the class member data and virtual methods */
@@ -27,62 +81,213 @@ struct tinyrl {
 	FILE *ostream;
 	const char *line;
 	unsigned max_line_length;
+	size_t max_buffer_size;
 	const char *prompt;
+	/* the line being edited has a gap at offset gap, up to the last
+	 * end bytes of the buffer */
 	char *buffer;
 	size_t buffer_size;
+	size_t gap;
 	bool done;
 	unsigned point;
 	unsigned end;
 	char *kill_string;
-	struct tinyrl_keymap *keymap;
+	struct tinyrl_keymap_entry *keymap;
+	tinyrl_key_func_t *grab;
+	void *grab_context;
 
 	char echo_char;
 	bool echo_enabled;
 	bool isatty;
-
-	char *last_buffer;
-	size_t last_end;
-	size_t last_row;
-	size_t last_point_row;
+	bool script_echo;
+
+	/* a script which is a regular file, mapped into memory */
+	char *script;
+	size_t script_size;
+	size_t script_pos;
+	size_t script_released;
+	bool bracketed_paste;
+	int escape_timeout;
+
+	/* bytes read from istream but not yet decoded */
+	char *input;
+	size_t input_size;
+	size_t input_start;
+	size_t input_end;
+	bool input_short;
+	bool input_expired;
+	bool input_eof;
+	bool pasting;
+	bool redisplay_pending;
+	bool typeahead;
+	int typeahead_latency;
+	long long redisplay_time;
+
+	/* output composed but not yet written to ostream, or for a
+	 * session, not yet taken with tinyrl_output() */
+	char *output;
+	size_t output_size;
+	size_t output_start;
+	size_t output_end;
+	struct tinyrl_output_stats output_stats;
+	bool feed_ready;
+
+	/* the layout of the line, and what it replaces on the screen from
+	 * the first changed row */
+	struct tinyrl_frame frame;
+	struct tinyrl_frame screen;
+	bool displayed;
+	size_t dirty;
+
+	/* long lines are shown on one row, from offset view */
+	size_t scroll_threshold;
+	size_t view;
+	bool scrolled;
+	size_t screen_rows;
+	size_t cursor_row;
+	size_t cursor_col;
+	bool cursor_wrap;
+	bool insert_delete;
+
+	/* the terminal width, as last found or set */
+	size_t width;
+	bool width_fixed;
+	sig_atomic_t width_resizes;
 };
 
+/* the number of calls to tinyrl_window_changed() */
+static volatile sig_atomic_t tinyrl_resizes;
+
 #define ESCAPESTR "\x1b"
 #define ESCAPE 27
 #define BACKSPACE 127
 
+/*
+ * Make room for len more bytes of output.
+ */
+/*
+ * Move the output which hasn't been sent yet to the start of the buffer,
+ * so that the space a client has already taken can be used again.
+ */
+static void tinyrl_output_compact(struct tinyrl *this)
+{
+	memmove(this->output, this->output + this->output_start,
+		this->output_end - this->output_start);
+	this->output_end -= this->output_start;
+	this->output_start = 0;
+}
+
+static bool tinyrl_output_reserve(struct tinyrl *this, size_t len)
+{
+	char *new_output;
+	size_t new_size;
+
+	if (this->output_size - this->output_end > len)
+		return true;
+
+	if (this->output_start) {
+		tinyrl_output_compact(this);
+		if (this->output_size - this->output_end > len)
+			return true;
+	}
+
+	new_size = this->output_size ? this->output_size : 256;
+	while (new_size - this->output_end <= len)
+		new_size *= 2;
+	new_output = realloc(this->output, new_size);
+	if (!new_output)
+		return false;
+	this->output = new_output;
+	this->output_size = new_size;
+
+	return true;
+}
+
+static void tinyrl_output_write(struct tinyrl *this, const char *text, size_t len)
+{
+	if (!tinyrl_output_reserve(this, len))
+		return;
+	memcpy(this->output + this->output_end, text, len);
+	this->output_end += len;
+	this->output_stats.bytes += len;
+}
+
+static void tinyrl_output_string(struct tinyrl *this, const char *text)
+{
+	tinyrl_output_write(this, text, strlen(text));
+}
+
+/*
+ * Append a control sequence with a single numeric parameter.
+ */
+static void tinyrl_output_csi(struct tinyrl *this, unsigned count, char final)
+{
+	char seq[16], *p = seq + sizeof(seq);
+
+	*--p = final;
+	do {
+		*--p = '0' + count % 10;
+		count /= 10;
+	} while (count);
+	*--p = '[';
+	*--p = ESCAPE;
+
+	tinyrl_output_write(this, p, seq + sizeof(seq) - p);
+}
+
 static void tinyrl_vt100_clear_screen(struct tinyrl *this)
 {
-	tinyrl_printf(this, "\x1b[2J");
+	tinyrl_output_string(this, "\x1b[2J");
 }
 
 static void tinyrl_vt100_erase_line_end(struct tinyrl *this)
 {
-	tinyrl_printf(this, "\x1b[0K");
+	tinyrl_output_string(this, "\x1b[0K");
 }
 
 static void tinyrl_vt100_erase_line(struct tinyrl *this)
 {
-	tinyrl_printf(this, "\x1b[2K");
+	tinyrl_output_string(this, "\x1b[2K");
+}
+
+static void tinyrl_vt100_erase_down(struct tinyrl *this)
+{
+	tinyrl_output_string(this, "\x1b[J");
 }
 
 static void tinyrl_vt100_cursor_up(struct tinyrl *this, unsigned count)
 {
-	tinyrl_printf(this, "\x1b[%dA", count);
+	tinyrl_output_csi(this, count, 'A');
 }
 
 static void tinyrl_vt100_cursor_down(struct tinyrl *this, unsigned count)
 {
-	tinyrl_printf(this, "\x1b[%dB", count);
+	tinyrl_output_csi(this, count, 'B');
 }
 
 static void tinyrl_vt100_cursor_forward(struct tinyrl *this, unsigned count)
 {
-	tinyrl_printf(this, "\x1b[%dC", count);
+	tinyrl_output_csi(this, count, 'C');
+}
+
+static void tinyrl_vt100_cursor_back(struct tinyrl *this, unsigned count)
+{
+	tinyrl_output_csi(this, count, 'D');
+}
+
+static void tinyrl_vt100_insert_chars(struct tinyrl *this, unsigned count)
+{
+	tinyrl_output_csi(this, count, '@');
+}
+
+static void tinyrl_vt100_delete_chars(struct tinyrl *this, unsigned count)
+{
+	tinyrl_output_csi(this, count, 'P');
 }
 
 static void tinyrl_vt100_cursor_home(struct tinyrl *this)
 {
-	tinyrl_printf(this, "\x1b[H");
+	tinyrl_output_string(this, "\x1b[H");
 }
 
 static void tty_set_raw_mode(FILE *istream, struct termios *old_termios)
@@ -113,6 +318,292 @@ static void tty_restore_mode(FILE *istream, struct termios *old_termios)
 	tcsetattr(fd, TCSAFLUSH, old_termios);
 }
 
+/*
+ * Write out the composed output in one go.  This is done at the end of
+ * a line, after a redisplay and before waiting for input, so that the
+ * output of several tinyrl_printf() calls shares a write.  A session's
+ * output waits for tinyrl_output() instead.
+ */
+static void tinyrl_flush(struct tinyrl *this)
+{
+	struct pollfd pfd;
+	ssize_t n;
+	int fd;
+
+	if (!this->ostream)
+		return;
+
+	/* anything the caller wrote with stdio comes first */
+	fflush(this->ostream);
+
+	fd = fileno(this->ostream);
+	if (fd < 0) {
+		fwrite(this->output + this->output_start, 1,
+		       this->output_end - this->output_start, this->ostream);
+		fflush(this->ostream);
+		this->output_start = this->output_end;
+	}
+
+	while (this->output_start < this->output_end) {
+		n = write(fd, this->output + this->output_start,
+			  this->output_end - this->output_start);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				break;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			(void)poll(&pfd, 1, -1);
+			continue;
+		}
+		this->output_start += n;
+		this->output_stats.writes++;
+	}
+
+	/* output which could not be written is dropped */
+	this->output_start = 0;
+	this->output_end = 0;
+}
+
+static size_t tinyrl_input_pending(const struct tinyrl *this)
+{
+	return this->input_end - this->input_start;
+}
+
+/*
+ * Move the pending bytes to the start of the buffer.  They are always
+ * kept contiguous so that keys can be decoded in place.
+ */
+static void tinyrl_input_compact(struct tinyrl *this)
+{
+	memmove(this->input, this->input + this->input_start,
+		tinyrl_input_pending(this));
+	this->input_end -= this->input_start;
+	this->input_start = 0;
+}
+
+/*
+ * Waiting for input was interrupted by a signal.  If the window was
+ * resized then the line is shown again at the new width.
+ * Returns true to carry on waiting.
+ */
+static bool tinyrl_input_interrupted(struct tinyrl *this)
+{
+	if (this->displayed && !this->width_fixed
+	    && this->width_resizes != tinyrl_resizes)
+		tinyrl_redisplay(this);
+	return true;
+}
+
+/*
+ * Read as much input as is available with a single read().
+ * Returns the number of bytes now pending, which is 0 on end of
+ * file, error, or if the stream is non-blocking and has no data.
+ * Instances without an istream are only given input by tinyrl_feed().
+ */
+static size_t tinyrl_input_fill(struct tinyrl *this)
+{
+	ssize_t len;
+
+	if (this->input_start == this->input_end) {
+		this->input_start = 0;
+		this->input_end = 0;
+	} else if (this->input_end == this->input_size) {
+		tinyrl_input_compact(this);
+	}
+
+	if (!this->istream)
+		return tinyrl_input_pending(this);
+
+	tinyrl_flush(this);
+	do {
+		len = read(fileno(this->istream), this->input + this->input_end,
+			   this->input_size - this->input_end);
+	} while (len < 0 && errno == EINTR && tinyrl_input_interrupted(this));
+
+	if (len > 0)
+		this->input_end += len;
+
+	return tinyrl_input_pending(this);
+}
+
+/*
+ * Make room for at least len bytes of input after those pending.
+ */
+static bool tinyrl_input_reserve(struct tinyrl *this, size_t len)
+{
+	char *new_input;
+	size_t new_size;
+
+	if (this->input_size - this->input_end < len)
+		tinyrl_input_compact(this);
+
+	if (this->input_size - this->input_end < len) {
+		new_size = this->input_size;
+		while (new_size - this->input_end < len)
+			new_size *= 2;
+		new_input = realloc(this->input, new_size);
+		if (!new_input)
+			return false;
+		this->input = new_input;
+		this->input_size = new_size;
+	}
+
+	return true;
+}
+
+static bool tinyrl_input_append(struct tinyrl *this, const char *bytes, size_t len)
+{
+	if (!tinyrl_input_reserve(this, len))
+		return false;
+
+	memcpy(this->input + this->input_end, bytes, len);
+	this->input_end += len;
+	return true;
+}
+
+/*
+ * Returns the length of the UTF-8 character, 0 if more input is
+ * needed, or -1 if the input is invalid.
+ */
+static int tinyrl_getchar(struct tinyrl *this, char *key)
+{
+	size_t key_len;
+
+	if (!tinyrl_input_pending(this))
+		return 0;
+
+	key_len = utf8_char_len(this->input[this->input_start]);
+	if (!key_len) {
+		this->input_start++;
+		return -1;
+	}
+
+	if (tinyrl_input_pending(this) < key_len)
+		return 0;
+
+	memcpy(key, this->input + this->input_start, key_len);
+	key[key_len] = 0;
+	this->input_start += key_len;
+
+	if (utf8_char_decode(key, key_len, NULL) != key_len)
+		return -1;
+
+	return key_len;
+}
+
+/*
+ * Wait up to timeout milliseconds for the stream to become readable,
+ * then read whatever is available.  Returns the number of bytes pending.
+ */
+static size_t tinyrl_input_wait(struct tinyrl *this, int timeout)
+{
+	struct pollfd pfd;
+	int status;
+
+	if (!this->istream)
+		return tinyrl_input_pending(this);
+
+	if (timeout)
+		tinyrl_flush(this);
+	pfd.fd = fileno(this->istream);
+	pfd.events = POLLIN;
+	do {
+		status = poll(&pfd, 1, timeout);
+	} while (status < 0 && errno == EINTR && tinyrl_input_interrupted(this));
+
+	if (status <= 0)
+		return tinyrl_input_pending(this);
+
+	return tinyrl_input_fill(this);
+}
+
+/*
+ * Make sure that at least len bytes are pending, allowing the escape
+ * timeout for each further read.  Returns false if they didn't arrive.
+ * An instance that is fed its input can't wait here, so instead it
+ * notes that the key is incomplete until tinyrl_feed_timeout().
+ */
+static bool tinyrl_input_wait_len(struct tinyrl *this, size_t len)
+{
+	size_t pending;
+
+	while ((pending = tinyrl_input_pending(this)) < len) {
+		if (!this->istream) {
+			this->input_short = !this->input_expired;
+			return false;
+		}
+		if (tinyrl_input_wait(this, this->escape_timeout) == pending)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Get the next key from the input: either a single UTF-8 character or
+ * a whole escape sequence.  CSI (ESC [) sequences are read up to their
+ * final byte, including any parameters, SS3 (ESC O) sequences take one
+ * more byte, and ESC followed by any other character is a meta key.
+ * An ESC which isn't followed by anything within the escape timeout is
+ * returned as a key on its own.
+ * Returns the length of the key, 0 if more input is needed, or -1 if
+ * the input is invalid.
+ */
+static int tinyrl_getkey(struct tinyrl *this, char *key)
+{
+	const char *s;
+	size_t len, char_len;
+	unsigned char c;
+
+	if (!tinyrl_input_pending(this))
+		return 0;
+
+	if (this->input[this->input_start] != ESCAPE)
+		return tinyrl_getchar(this, key);
+
+	this->input_short = false;
+	len = 1;
+	if (tinyrl_input_wait_len(this, 2)) {
+		s = this->input + this->input_start;
+		if (s[1] == '[') {
+			for (len = 2; len < KEY_SIZE - 1; len++) {
+				if (!tinyrl_input_wait_len(this, len + 1))
+					break;
+				s = this->input + this->input_start;
+				c = s[len];
+				if (c >= 0x40 && c <= 0x7e) {
+					/* final byte */
+					len++;
+					break;
+				}
+				/* parameter and intermediate bytes */
+				if (c < 0x20 || c > 0x3f)
+					break;
+			}
+		} else if (s[1] == 'O') {
+			len = tinyrl_input_wait_len(this, 3) ? 3 : 2;
+		} else if (s[1] != ESCAPE) {
+			char_len = utf8_char_len(s[1]);
+			if (char_len && tinyrl_input_wait_len(this, 1 + char_len)) {
+				s = this->input + this->input_start;
+				if (utf8_char_decode(s + 1, char_len, NULL) == char_len)
+					len = 1 + char_len;
+			}
+		}
+	}
+
+	if (this->input_short)
+		return 0;
+
+	memcpy(key, this->input + this->input_start, len);
+	key[len] = 0;
+	this->input_start += len;
+
+	return len;
+}
+
 /*
    This is called whenever a line is edited in any way.
    It signals that if we are currently viewing a history line we should transfer it
@@ -125,11 +616,77 @@ static void changed_line(struct tinyrl *this)
 		/* replace the current buffer with the new details */
 		free(this->buffer);
 		this->line = this->buffer = strdup(this->line);
-		this->buffer_size = strlen(this->buffer);
 		assert(this->line);
+		this->buffer_size = strlen(this->buffer);
+		this->gap = this->buffer_size;
 	}
 }
 
+/*
+ * Move the gap in the line buffer to offset.
+ */
+static void tinyrl_gap_move(struct tinyrl *this, size_t offset)
+{
+	size_t gap_len = this->buffer_size - this->end;
+
+	if (offset < this->gap)
+		memmove(this->buffer + offset + gap_len, this->buffer + offset,
+			this->gap - offset);
+	else if (offset > this->gap)
+		memmove(this->buffer + this->gap, this->buffer + this->gap + gap_len,
+			offset - this->gap);
+	this->gap = offset;
+}
+
+/*
+ * Get the text of the line before offset, as a contiguous string.
+ */
+static const char *tinyrl_line_before(struct tinyrl *this, size_t offset)
+{
+	if (this->line != this->buffer)
+		return this->line;
+
+	tinyrl_gap_move(this, offset);
+	return this->buffer;
+}
+
+/*
+ * Get the text of the line after offset, as a contiguous string.
+ */
+static const char *tinyrl_line_after(struct tinyrl *this, size_t offset)
+{
+	if (this->line != this->buffer)
+		return this->line + offset;
+
+	tinyrl_gap_move(this, offset);
+	return this->buffer + this->buffer_size - (this->end - offset);
+}
+
+/*
+ * Get the whole line as a contiguous string, by closing the gap.
+ */
+static const char *tinyrl_line_text(struct tinyrl *this)
+{
+	if (this->line != this->buffer)
+		return this->line;
+
+	tinyrl_gap_move(this, this->end);
+	this->buffer[this->end] = '\0';
+	return this->buffer;
+}
+
+/*
+ * Note that the line may have changed from offset onwards, so that the
+ * next redisplay only lays out the line again from there.
+ */
+static void tinyrl_line_changed(struct tinyrl *this, size_t offset)
+{
+	if (offset < this->dirty)
+		this->dirty = offset;
+	if (offset < this->view)
+		this->view = 0;
+}
+
 static bool tinyrl_key_default(void *context, char *key)
 {
 	struct tinyrl *this = context;
@@ -173,7 +730,7 @@ static bool tinyrl_key_kill(void *context, char *key)
 	free(this->kill_string);
 
 	/* store the killed string */
-	this->kill_string = strdup(&this->buffer[this->point]);
+	this->kill_string = strdup(tinyrl_line_after(this, this->point));
 
 	/* delete the text to the end of the line */
 	tinyrl_delete_text(this, this->point, this->end);
@@ -205,7 +762,8 @@ static bool tinyrl_key_left(void *context, char *key)
 	struct tinyrl *this = context;
 	bool result = false;
 	if (this->point > 0) {
-		this->point = utf8_grapheme_prev(this->line, this->end, this->point);
+		this->point = utf8_grapheme_prev(tinyrl_line_before(this, this->point),
+						 this->point, this->point);
 		result = true;
 	}
 	return result;
@@ -216,7 +774,8 @@ static bool tinyrl_key_right(void *context, char *key)
 	struct tinyrl *this = context;
 	bool result = false;
 	if (this->point < this->end) {
-		this->point = utf8_grapheme_next(this->line, this->end, this->point);
+		this->point += utf8_grapheme_next(tinyrl_line_after(this, this->point),
+						  this->end - this->point, 0);
 		result = true;
 	}
 	return result;
@@ -230,7 +789,8 @@ static bool tinyrl_key_backspace(void *context, char *key)
 
 	if (this->point) {
 		end = this->point;
-		this->point = utf8_char_prev(this->line, this->end, this->point);
+		this->point = utf8_char_prev(tinyrl_line_before(this, this->point),
+					     this->point, this->point);
 		tinyrl_delete_text(this, this->point, end);
 		result = true;
 	}
@@ -244,7 +804,9 @@ static bool tinyrl_key_delete(void *context, char *key)
 	size_t end;
 
 	if (this->point < this->end) {
-		end = utf8_grapheme_next(this->line, this->end, this->point);
+		end = this->point
+		    + utf8_grapheme_next(tinyrl_line_after(this, this->point),
+					 this->end - this->point, 0);
 		tinyrl_delete_text(this, this->point, end);
 		result = true;
 	}
@@ -270,89 +832,492 @@ static bool tinyrl_key_erase_line(void *context, char *key)
 	return true;
 }
 
-static struct tinyrl_keymap *tinyrl_keymap_new()
+/*
+ * Insert pending bracketed paste text, up to the closing ESC [ 201 ~,
+ * directly from the input buffer without dispatching the pasted bytes as
+ * keys.  Line breaks and tabs become spaces so that a paste can't submit
+ * the line, and other control characters and invalid UTF-8 are dropped.
+ * Returns 1 if input was consumed, or 0 if more input is needed.
+ */
+static int tinyrl_insert_paste(struct tinyrl *this)
 {
-	struct tinyrl_keymap *keymap;
-	int i;
+	static const char paste_end[] = ESCAPESTR "[201~";
+	size_t len, char_len, pending;
+	char *text;
+	int result = 0;
+
+	while ((pending = tinyrl_input_pending(this))) {
+		text = this->input + this->input_start;
+		if (*text == ESCAPE) {
+			if (pending < sizeof(paste_end) - 1
+			    && !memcmp(text, paste_end, pending))
+				break;
+			if (!memcmp(text, paste_end, sizeof(paste_end) - 1)) {
+				this->input_start += sizeof(paste_end) - 1;
+				this->pasting = false;
+				return 1;
+			}
+		}
 
-	keymap = malloc(sizeof(*keymap));
+		/* find the run of text that can be inserted as is */
+		for (len = 0; len < pending; len += char_len) {
+			if (text[len] == '\r' && len + 1 < pending
+			    && text[len + 1] == '\n')
+				break;
+			if (text[len] == '\r' || text[len] == '\n' || text[len] == '\t')
+				text[len] = ' ';
+			if ((unsigned char)text[len] < ' ' || text[len] == BACKSPACE)
+				break;
+			char_len = utf8_char_len(text[len]);
+			if (!char_len || len + char_len > pending
+			    || utf8_char_decode(text + len, char_len, NULL) != char_len)
+				break;
+		}
+
+		if (!len) {
+			/* wait for the rest of a split character */
+			if (utf8_char_len(*text) > pending)
+				break;
+			/* skip the offending byte */
+			this->input_start++;
+			result = 1;
+			continue;
+		}
 
-	for (i = 0; i < KEYMAP_SIZE; i++) {
-		keymap->handler[i] = NULL;
-		keymap->keymap[i] = NULL;
-		keymap->context[i] = NULL;
+		if (!tinyrl_insert_text_len(this, text, len))
+			tinyrl_ding(this);
+		this->input_start += len;
+		result = 1;
 	}
 
-	return keymap;
+	return result;
 }
 
-static void tinyrl_keymap_free(struct tinyrl_keymap *keymap)
+static bool tinyrl_key_paste(void *context, char *key)
 {
-	int i;
+	struct tinyrl *this = context;
 
-	for (i = 0; i < KEYMAP_SIZE; i++)
-		if (keymap->keymap[i])
-			tinyrl_keymap_free(keymap->keymap[i]);
-	free(keymap);
+	this->pasting = true;
+	tinyrl_insert_paste(this);
+	return true;
 }
 
-static void tinyrl_fini(struct tinyrl *this)
-{
-	/* free up any dynamic strings */
-	free(this->buffer);
-	this->buffer = NULL;
-	free(this->kill_string);
-	this->kill_string = NULL;
-	free(this->last_buffer);
-	tinyrl_keymap_free(this->keymap);
-}
+/*
+ * The default bindings are shared by all instances.  Their context
+ * stands for the instance that the key was pressed in.
+ */
+static char tinyrl_self;
+#define SELF ((void *)&tinyrl_self)
 
-static void
-tinyrl_init(struct tinyrl *this, FILE * instream, FILE * outstream)
-{
-	int i;
+static struct tinyrl_keymap_key tinyrl_keymap_csi_200[] = {
+	{ '~', { tinyrl_key_paste, SELF, NULL } },
+};
 
-	this->keymap = tinyrl_keymap_new();
-	for (i = 32; i < 256; i++)
-		tinyrl_bind_key(this, i, tinyrl_key_default, this);
-	tinyrl_bind_key(this, '\r', tinyrl_key_crlf, this);
-	tinyrl_bind_key(this, '\n', tinyrl_key_crlf, this);
-	tinyrl_bind_key(this, CTRL('C'), tinyrl_key_interrupt, this);
-	tinyrl_bind_key(this, BACKSPACE, tinyrl_key_backspace, this);
-	tinyrl_bind_key(this, CTRL('H'), tinyrl_key_backspace, this);
-	tinyrl_bind_key(this, CTRL('D'), tinyrl_key_delete, this);
-	tinyrl_bind_key(this, CTRL('L'), tinyrl_key_clear_screen, this);
-	tinyrl_bind_key(this, CTRL('U'), tinyrl_key_erase_line, this);
-	tinyrl_bind_key(this, CTRL('A'), tinyrl_key_start_of_line, this);
-	tinyrl_bind_key(this, CTRL('E'), tinyrl_key_end_of_line, this);
-	tinyrl_bind_key(this, CTRL('K'), tinyrl_key_kill, this);
-	tinyrl_bind_key(this, CTRL('Y'), tinyrl_key_yank, this);
-	tinyrl_bind_special(this, TINYRL_KEY_RIGHT, tinyrl_key_right, this);
-	tinyrl_bind_special(this, TINYRL_KEY_LEFT, tinyrl_key_left, this);
-	tinyrl_bind_special(this, TINYRL_KEY_HOME, tinyrl_key_start_of_line, this);
-	tinyrl_bind_special(this, TINYRL_KEY_END, tinyrl_key_end_of_line, this);
-	tinyrl_bind_special(this, TINYRL_KEY_INSERT, NULL, NULL);
-	tinyrl_bind_special(this, TINYRL_KEY_DELETE, tinyrl_key_delete, this);
+static struct tinyrl_keymap tinyrl_default_csi_200 = {
+	true, 1, tinyrl_keymap_csi_200
+};
 
-	this->line = NULL;
-	this->max_line_length = 0;
-	this->prompt = NULL;
-	this->buffer = NULL;
-	this->buffer_size = 0;
-	this->done = false;
-	this->point = 0;
-	this->end = 0;
-	this->kill_string = NULL;
-	this->echo_char = '\0';
-	this->echo_enabled = true;
-	this->isatty = isatty(fileno(instream));
-	this->last_buffer = NULL;
-	this->last_end = 0;
-	this->last_row = 0;
-	this->last_point_row = 0;
+static struct tinyrl_keymap_key tinyrl_keymap_csi_20[] = {
+	{ '0', { NULL, NULL, &tinyrl_default_csi_200 } },
+};
+
+static struct tinyrl_keymap tinyrl_default_csi_20 = {
+	true, 1, tinyrl_keymap_csi_20
+};
+
+static struct tinyrl_keymap_key tinyrl_keymap_csi_2[] = {
+	{ '0', { NULL, NULL, &tinyrl_default_csi_20 } },
+};
+
+static struct tinyrl_keymap tinyrl_default_csi_2 = {
+	true, 1, tinyrl_keymap_csi_2
+};
+
+static struct tinyrl_keymap_key tinyrl_keymap_csi_3[] = {
+	{ '~', { tinyrl_key_delete, SELF, NULL } },
+};
+
+static struct tinyrl_keymap tinyrl_default_csi_3 = {
+	true, 1, tinyrl_keymap_csi_3
+};
+
+static struct tinyrl_keymap_key tinyrl_keymap_csi[] = {
+	{ '2', { NULL, NULL, &tinyrl_default_csi_2 } },
+	{ '3', { NULL, NULL, &tinyrl_default_csi_3 } },
+	{ 'C', { tinyrl_key_right, SELF, NULL } },
+	{ 'D', { tinyrl_key_left, SELF, NULL } },
+};
+
+static struct tinyrl_keymap tinyrl_default_csi = {
+	true, 4, tinyrl_keymap_csi
+};
+
+static struct tinyrl_keymap_key tinyrl_keymap_ss3[] = {
+	{ 'F', { tinyrl_key_end_of_line, SELF, NULL } },
+	{ 'H', { tinyrl_key_start_of_line, SELF, NULL } },
+};
+
+static struct tinyrl_keymap tinyrl_default_ss3 = {
+	true, 2, tinyrl_keymap_ss3
+};
+
+static struct tinyrl_keymap_key tinyrl_keymap_escape[] = {
+	{ 'O', { NULL, NULL, &tinyrl_default_ss3 } },
+	{ '[', { NULL, NULL, &tinyrl_default_csi } },
+};
+
+static struct tinyrl_keymap tinyrl_default_escape = {
+	true, 2, tinyrl_keymap_escape
+};
+
+static struct tinyrl_keymap_entry tinyrl_default_keymap[KEYMAP_SIZE] = {
+	[32 ... 255] = { tinyrl_key_default, SELF, NULL },
+	['\r'] = { tinyrl_key_crlf, SELF, NULL },
+	['\n'] = { tinyrl_key_crlf, SELF, NULL },
+	[CTRL('C')] = { tinyrl_key_interrupt, SELF, NULL },
+	[BACKSPACE] = { tinyrl_key_backspace, SELF, NULL },
+	[CTRL('H')] = { tinyrl_key_backspace, SELF, NULL },
+	[CTRL('D')] = { tinyrl_key_delete, SELF, NULL },
+	[CTRL('L')] = { tinyrl_key_clear_screen, SELF, NULL },
+	[CTRL('U')] = { tinyrl_key_erase_line, SELF, NULL },
+	[CTRL('A')] = { tinyrl_key_start_of_line, SELF, NULL },
+	[CTRL('E')] = { tinyrl_key_end_of_line, SELF, NULL },
+	[CTRL('K')] = { tinyrl_key_kill, SELF, NULL },
+	[CTRL('Y')] = { tinyrl_key_yank, SELF, NULL },
+	[ESCAPE] = { NULL, NULL, &tinyrl_default_escape },
+};
+
+static struct tinyrl_keymap *tinyrl_keymap_new(void)
+{
+	struct tinyrl_keymap *keymap;
+
+	keymap = malloc(sizeof(*keymap));
+	if (!keymap)
+		return NULL;
+	keymap->shared = false;
+	keymap->count = 0;
+	keymap->keys = NULL;
+
+	return keymap;
+}
+
+/*
+ * Make a private copy of a shared keymap.  The keymaps below it are
+ * still shared until they are changed too.
+ */
+static struct tinyrl_keymap *tinyrl_keymap_copy(const struct tinyrl_keymap *keymap)
+{
+	struct tinyrl_keymap *copy;
+	size_t size = keymap->count * sizeof(*keymap->keys);
+
+	copy = malloc(sizeof(*copy));
+	if (!copy)
+		return NULL;
+	copy->keys = malloc(size);
+	if (!copy->keys) {
+		free(copy);
+		return NULL;
+	}
+	memcpy(copy->keys, keymap->keys, size);
+	copy->shared = false;
+	copy->count = keymap->count;
+
+	return copy;
+}
+
+static void tinyrl_keymap_free(struct tinyrl_keymap *keymap)
+{
+	unsigned i;
+
+	if (keymap->shared)
+		return;
+
+	for (i = 0; i < keymap->count; i++)
+		if (keymap->keys[i].entry.keymap)
+			tinyrl_keymap_free(keymap->keys[i].entry.keymap);
+	free(keymap->keys);
+	free(keymap);
+}
+
+/*
+ * Binary search for the key.  Returns the index at which it is, or
+ * would be inserted.
+ */
+static unsigned tinyrl_keymap_search(const struct tinyrl_keymap *keymap,
+				     unsigned char key)
+{
+	unsigned lo = 0, hi = keymap->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (keymap->keys[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct tinyrl_keymap_entry *
+tinyrl_keymap_find(const struct tinyrl_keymap *keymap, unsigned char key)
+{
+	unsigned i = tinyrl_keymap_search(keymap, key);
+
+	if (i < keymap->count && keymap->keys[i].key == key)
+		return &keymap->keys[i].entry;
+	return NULL;
+}
+
+static struct tinyrl_keymap_entry *
+tinyrl_keymap_add(struct tinyrl_keymap *keymap, unsigned char key)
+{
+	struct tinyrl_keymap_key *keys;
+	unsigned i = tinyrl_keymap_search(keymap, key);
+
+	if (i < keymap->count && keymap->keys[i].key == key)
+		return &keymap->keys[i].entry;
+
+	keys = realloc(keymap->keys, (keymap->count + 1) * sizeof(*keys));
+	if (!keys)
+		return NULL;
+	memmove(&keys[i + 1], &keys[i], (keymap->count - i) * sizeof(*keys));
+	keys[i].key = key;
+	keys[i].entry.handler = NULL;
+	keys[i].entry.context = NULL;
+	keys[i].entry.keymap = NULL;
+	keymap->keys = keys;
+	keymap->count++;
+
+	return &keys[i].entry;
+}
+
+/*
+ * Look up the first key of a sequence.
+ */
+static const struct tinyrl_keymap_entry *
+tinyrl_keymap_root(const struct tinyrl *this, unsigned char key)
+{
+	return &this->keymap[key];
+}
+
+/*
+ * Look up the first key of a sequence so that it can be changed,
+ * copying the default bindings if they are still in use.
+ */
+static struct tinyrl_keymap_entry *
+tinyrl_keymap_root_own(struct tinyrl *this, unsigned char key)
+{
+	struct tinyrl_keymap_entry *keymap;
+
+	if (this->keymap == tinyrl_default_keymap) {
+		keymap = malloc(sizeof(tinyrl_default_keymap));
+		if (!keymap)
+			return NULL;
+		memcpy(keymap, tinyrl_default_keymap,
+		       sizeof(tinyrl_default_keymap));
+		this->keymap = keymap;
+	}
+	return &this->keymap[key];
+}
+
+/*
+ * Returns false if a keymap couldn't be allocated, leaving the bindings
+ * as they were.
+ */
+static bool tinyrl_bind_keyseq(struct tinyrl *this, const char *seq,
+			       tinyrl_key_func_t *handler, void *context)
+{
+	struct tinyrl_keymap_entry *entry;
+	struct tinyrl_keymap *keymap;
+
+	if (!*seq)
+		return true;
+
+	entry = tinyrl_keymap_root_own(this, *seq++);
+	if (!entry)
+		return false;
+
+	while (*seq) {
+		keymap = entry->keymap;
+		if (!keymap)
+			keymap = tinyrl_keymap_new();
+		else if (keymap->shared)
+			keymap = tinyrl_keymap_copy(keymap);
+		if (!keymap)
+			return false;
+		entry->keymap = keymap;
+		entry = tinyrl_keymap_add(keymap, *seq++);
+		if (!entry)
+			return false;
+	}
+
+	entry->handler = handler;
+	entry->context = context;
+	return true;
+}
+
+static void tinyrl_fini(struct tinyrl *this)
+{
+	unsigned i;
+
+	/* free up any dynamic strings */
+	free(this->buffer);
+	this->buffer = NULL;
+	free(this->kill_string);
+	this->kill_string = NULL;
+	free(this->screen.text);
+	free(this->screen.cells);
+	free(this->frame.text);
+	free(this->frame.cells);
+	free(this->input);
+	free(this->output);
+	if (this->keymap != tinyrl_default_keymap) {
+		for (i = 0; i < KEYMAP_SIZE; i++)
+			if (this->keymap[i].keymap)
+				tinyrl_keymap_free(this->keymap[i].keymap);
+		free(this->keymap);
+	}
+	if (this->script)
+		munmap(this->script, this->script_size);
+}
+
+/*
+ * Map a script which is a regular file into memory, so that its lines
+ * can be returned in place rather than read.  Other streams, such as
+ * pipes, are read a block at a time.
+ */
+static void tinyrl_script_map(struct tinyrl *this)
+{
+	int fd = fileno(this->istream);
+	struct stat st;
+	off_t offset;
+	void *map;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st.st_size)
+		return;
+
+	/* read-only, so that its pages are only ever those of the file */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	this->script = map;
+	this->script_size = st.st_size;
+	this->script_pos = offset;
+}
+
+/*
+ * Make the input buffer big enough to read a script which can't be
+ * mapped, such as a pipe, in large blocks.
+ */
+static void tinyrl_script_buffer(struct tinyrl *this)
+{
+	struct stat st;
+	size_t size = SCRIPT_BLOCK;
+
+	if (fstat(fileno(this->istream), &st) == 0 && (size_t)st.st_blksize > size)
+		size = st.st_blksize;
+	(void)tinyrl_input_reserve(this, size);
+}
+
+static void
+tinyrl_init(struct tinyrl *this, FILE * instream, FILE * outstream)
+{
+	this->keymap = tinyrl_default_keymap;
+	this->grab = NULL;
+
+	this->line = NULL;
+	this->max_line_length = 0;
+	this->max_buffer_size = 256;
+	this->prompt = NULL;
+	this->buffer = NULL;
+	this->buffer_size = 0;
+	this->gap = 0;
+	this->done = false;
+	this->point = 0;
+	this->end = 0;
+	this->kill_string = NULL;
+	this->echo_char = '\0';
+	this->echo_enabled = true;
+	this->bracketed_paste = false;
+	this->escape_timeout = ESCAPE_TIMEOUT;
+	this->isatty = instream ? isatty(fileno(instream)) : true;
+	this->script = NULL;
+	this->script_size = 0;
+	this->script_pos = 0;
+	this->script_released = 0;
+	this->input = malloc(INPUT_SIZE);
+	this->input_size = INPUT_SIZE;
+	this->input_start = 0;
+	this->input_end = 0;
+	this->input_short = false;
+	this->input_expired = false;
+	this->input_eof = false;
+	this->pasting = false;
+	this->redisplay_pending = false;
+	this->typeahead = false;
+	this->typeahead_latency = 0;
+	this->script_echo = true;
+	this->redisplay_time = 0;
+	this->output = NULL;
+	this->output_size = 0;
+	this->output_start = 0;
+	this->output_end = 0;
+	memset(&this->output_stats, 0, sizeof(this->output_stats));
+	this->feed_ready = false;
+	memset(&this->screen, 0, sizeof(this->screen));
+	memset(&this->frame, 0, sizeof(this->frame));
+	this->displayed = false;
+	this->dirty = SIZE_MAX;
+	this->scroll_threshold = 4096;
+	this->view = 0;
+	this->scrolled = false;
+	this->screen_rows = 0;
+	this->cursor_row = 0;
+	this->cursor_col = 0;
+	this->cursor_wrap = false;
+	this->insert_delete = false;
+	this->width = 0;
+	this->width_fixed = false;
+	this->width_resizes = 0;
 
 	this->istream = instream;
 	this->ostream = outstream;
+
+	if (!this->isatty) {
+		tinyrl_script_map(this);
+		if (!this->script)
+			tinyrl_script_buffer(this);
+	}
+}
+
+/*
+ * Append formatted output to the output buffer.
+ */
+static int tinyrl_vbprintf(struct tinyrl *this, const char *fmt, va_list args)
+{
+	va_list args2;
+	int len;
+
+	va_copy(args2, args);
+	len = vsnprintf(this->output ? this->output + this->output_end : NULL,
+			this->output_size - this->output_end, fmt, args2);
+	va_end(args2);
+	if (len > 0 && (size_t)len >= this->output_size - this->output_end) {
+		if (!tinyrl_output_reserve(this, len))
+			return -1;
+		len = vsnprintf(this->output + this->output_end,
+				this->output_size - this->output_end, fmt, args);
+	}
+	if (len > 0) {
+		this->output_end += len;
+		this->output_stats.bytes += len;
+	}
+	return len;
 }
 
 int tinyrl_printf(struct tinyrl *this, const char *fmt, ...)
@@ -361,7 +1326,7 @@ int tinyrl_printf(struct tinyrl *this, const char *fmt, ...)
 	int len;
 
 	va_start(args, fmt);
-	len = vfprintf(this->ostream, fmt, args);
+	len = tinyrl_vbprintf(this, fmt, args);
 	va_end(args);
 
 	return len;
@@ -371,6 +1336,9 @@ void tinyrl_delete(struct tinyrl *this)
 {
 	assert(this);
 	if (this) {
+		/* don't lose anything printed since the last line */
+		tinyrl_flush(this);
+
 		/* let the object tidy itself up */
 		tinyrl_fini(this);
 
@@ -379,453 +1347,1394 @@ void tinyrl_delete(struct tinyrl *this)
 	}
 }
 
-static int tinyrl_getchar(const struct tinyrl *this, char *key)
+static bool tinyrl_frame_reserve(struct tinyrl_frame *frame,
+				 size_t len, size_t count)
 {
-	int c;
-	size_t i, key_len;
+	char *new_text;
+	struct tinyrl_cell *new_cells;
+	size_t new_size;
+
+	if (frame->text_size - (frame->len - frame->base) < len) {
+		new_size = frame->text_size ? frame->text_size : 64;
+		while (new_size - (frame->len - frame->base) < len)
+			new_size *= 2;
+		new_text = realloc(frame->text, new_size);
+		if (!new_text)
+			return false;
+		frame->text = new_text;
+		frame->text_size = new_size;
+	}
 
-	c = getc(this->istream);
-	if (c == EOF)
-		return -1;
+	if (frame->cells_size - frame->count < count) {
+		new_size = frame->cells_size ? frame->cells_size : 64;
+		while (new_size - frame->count < count)
+			new_size *= 2;
+		new_cells = realloc(frame->cells, new_size * sizeof(*new_cells));
+		if (!new_cells)
+			return false;
+		frame->cells = new_cells;
+		frame->cells_size = new_size;
+	}
 
-	key_len = utf8_char_len(c);
-	if (!key_len)
-		return -1;
+	return true;
+}
 
-	key[0] = c;
-	for (i = 1; i < key_len; i++) {
-		c = getc(this->istream);
-		if (c == EOF)
-			return -1;
-		key[i] = c;
-	}
-	key[i] = 0;
+static bool tinyrl_frame_append(struct tinyrl_frame *frame,
+				const char *text, size_t len)
+{
+	if (!tinyrl_frame_reserve(frame, len, 0))
+		return false;
+	memcpy(frame->text + frame->len - frame->base, text, len);
+	frame->len += len;
 
-	if (utf8_char_decode(key, key_len, NULL) != key_len)
-		return -1;
+	return true;
+}
 
-	return key_len;
+/*
+ * Append the line from offset onwards, from either side of the gap.
+ */
+static bool tinyrl_frame_append_line(struct tinyrl_frame *frame,
+				     const struct tinyrl *this, size_t offset)
+{
+	size_t gap_len;
+
+	if (this->line != this->buffer)
+		return tinyrl_frame_append(frame, this->line + offset,
+					   this->end - offset);
+
+	gap_len = this->buffer_size - this->end;
+	if (offset < this->gap) {
+		if (!tinyrl_frame_append(frame, this->buffer + offset,
+					 this->gap - offset))
+			return false;
+		offset = this->gap;
+	}
+	return tinyrl_frame_append(frame, this->buffer + offset + gap_len,
+				   this->end - offset);
 }
 
-static int tinyrl_getchar_nonblock(const struct tinyrl *this, char *key)
+static const char *tinyrl_cell_text(const struct tinyrl_frame *frame,
+				    const struct tinyrl_cell *cell)
 {
-	int fd;
-	int flags;
-	int key_len;
+	return frame->text + cell->offset - frame->base;
+}
 
-	fd = fileno(this->istream);
-	flags = fcntl(fd, F_GETFL, 0);
-	if (flags != -1)
-		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-	key_len = tinyrl_getchar(this, key);
-	if (flags != -1)
-		fcntl(fd, F_SETFL, flags);
-	return key_len;
+/*
+ * Find the first cell of the frame which starts at or after offset.
+ */
+static size_t tinyrl_frame_search(const struct tinyrl_frame *frame, size_t offset)
+{
+	size_t lo = 0, hi = frame->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (frame->cells[mid].offset < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
-static void tinyrl_internal_print(
-	struct tinyrl *this, char **buffer, size_t *point, size_t *end)
+/*
+ * Set the text of the frame to the prompt followed by the line as it
+ * should be shown, and find the offset of the point in it.  Text before
+ * the offset from is already in place when the line is echoed.
+ */
+static bool tinyrl_internal_print(
+	struct tinyrl *this, struct tinyrl_frame *frame, size_t from, size_t *point)
 {
-	if (this->echo_enabled) {
+	size_t prompt_len = strlen(this->prompt);
+	const char *line;
+	size_t i;
+
+	if (this->echo_enabled && from >= prompt_len) {
 		/* simply echo the line */
-		*point = this->point;
-		*end = this->end;
-		*buffer = strdup(this->line);
-	} else {
-		/* replace the line with echo char if defined */
-		if (this->echo_char) {
-			size_t i;
-
-			*point = 0;
-			*end = 0;
-			for (i = 0; ; i = utf8_grapheme_next(this->line, this->end, i)) {
-				if (i == this->point)
-					*point = *end;
-				if (i >= this->end)
-					break;
-				*end += 1;
-			}
+		*point = prompt_len + this->point;
+		if (from > prompt_len + this->end)
+			from = prompt_len + this->end;
+		frame->len = from;
+		return tinyrl_frame_append_line(frame, this, from - prompt_len);
+	}
 
-			*buffer = malloc(*end + 1);
-			if (*buffer) {
-				memset(*buffer, this->echo_char, *end);
-				(*buffer)[*end] = 0;
-			}
+	frame->len = 0;
+	if (!tinyrl_frame_append(frame, this->prompt, prompt_len))
+		return false;
+
+	if (this->echo_enabled) {
+		*point = frame->len + this->point;
+		return tinyrl_frame_append_line(frame, this, 0);
+	}
+
+	/* replace the line with echo char if defined */
+	*point = frame->len;
+	if (this->echo_char) {
+		line = tinyrl_line_text(this);
+		for (i = 0; ; i = utf8_grapheme_next(line, this->end, i)) {
+			if (i == this->point)
+				*point = frame->len;
+			if (i >= this->end)
+				break;
+			if (!tinyrl_frame_append(frame, &this->echo_char, 1))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Lay out the text of the frame in rows of the given width, keeping
+ * the cells before start.  A grapheme which does not fit at the end of
+ * a row starts the next.
+ */
+static bool tinyrl_frame_layout(
+	struct tinyrl_frame *frame, size_t width, size_t start)
+{
+	struct tinyrl_cell *cell;
+	size_t offset, next, cell_width;
+	size_t row, col;
+
+	row = col = offset = 0;
+	if (start) {
+		cell = &frame->cells[start - 1];
+		row = cell->row;
+		col = cell->col + cell->width;
+		offset = cell->offset + cell->len;
+	}
+
+	frame->count = start;
+	frame->width = width;
+	for (; offset < frame->len; offset = next) {
+		cell_width = utf8_grapheme_width(frame->text, frame->len, offset, &next);
+
+		if (!cell_width && frame->count) {
+			/* it is shown along with the grapheme before it */
+			frame->cells[frame->count - 1].len += next - offset;
+			continue;
+		}
+
+		if (col + cell_width > width) {
+			row++;
+			col = 0;
+		}
+
+		if (!tinyrl_frame_reserve(frame, 0, 1))
+			return false;
+		cell = &frame->cells[frame->count++];
+		cell->offset = offset;
+		cell->len = next - offset;
+		cell->row = row;
+		cell->col = col;
+		cell->width = cell_width;
+		col += cell_width;
+	}
+	frame->rows = row + 1;
+
+	return true;
+}
+
+/*
+ * Find where the cursor goes for the point.
+ */
+static void tinyrl_frame_point(struct tinyrl_frame *frame, size_t point)
+{
+	size_t i = tinyrl_frame_search(frame, point);
+	const struct tinyrl_cell *cell;
+
+	if (i < frame->count) {
+		frame->point_row = frame->cells[i].row;
+		frame->point_col = frame->cells[i].col;
+		return;
+	}
+
+	/* the point is at the end */
+	frame->point_row = frame->point_col = 0;
+	if (frame->count) {
+		cell = &frame->cells[frame->count - 1];
+		frame->point_row = cell->row;
+		frame->point_col = cell->col + cell->width;
+	}
+	if (frame->point_col >= frame->width) {
+		frame->point_row++;
+		frame->point_col = 0;
+	}
+}
+
+/*
+ * Set the text of the frame to the prompt and as much of a long line
+ * around the point as fits on the rest of the row, with markers where
+ * the line goes on beyond it.
+ */
+static bool tinyrl_view_print(
+	struct tinyrl *this, struct tinyrl_frame *frame, size_t width, size_t *point)
+{
+	const char *before, *after;
+	size_t room, used, view, len, i, next, cell_width;
+
+	/*
+	 * Find the room left on the row after the prompt.  The last column
+	 * is left blank, so that terminals never have to wrap the cursor.
+	 */
+	frame->len = 0;
+	if (!tinyrl_frame_append(frame, this->prompt, strlen(this->prompt))
+	    || !tinyrl_frame_layout(frame, width, 0))
+		return false;
+	tinyrl_frame_point(frame, frame->len);
+	room = width - frame->point_col - 1;
+	if (room < 4)
+		room += width;
+
+	before = tinyrl_line_before(this, this->point);
+	after = tinyrl_line_after(this, this->point);
+
+	/* keep the point in view, leaving room for the markers */
+	view = this->view;
+	used = 0;
+	if (view <= this->point) {
+		used = view > 0;
+		for (i = view; i < this->point && used + 2 <= room; i = next)
+			used += utf8_grapheme_width(before, this->point, i, &next);
+	}
+	if (view > this->point || used + 2 > room) {
+		/* scroll so that the point is near the middle */
+		used = 0;
+		for (view = this->point; view > 0; view = i) {
+			i = utf8_grapheme_prev(before, this->point, view);
+			cell_width = utf8_grapheme_width(before, this->point, i, NULL);
+			if (used + cell_width > (room - 3) / 2)
+				break;
+			used += cell_width;
+		}
+		used += view > 0;
+		this->view = view;
+	}
+
+	if (view > 0 && !tinyrl_frame_append(frame, "<", 1))
+		return false;
+	if (!tinyrl_frame_append(frame, before + view, this->point - view))
+		return false;
+	*point = frame->len;
+
+	/* fill the rest of the row */
+	len = this->end - this->point;
+	for (i = 0; i < len; i = next) {
+		cell_width = utf8_grapheme_width(after, len, i, &next);
+		if (used + cell_width + 1 > room)
+			break;
+		used += cell_width;
+	}
+	if (!tinyrl_frame_append(frame, after, i))
+		return false;
+	if (i < len && !tinyrl_frame_append(frame, ">", 1))
+		return false;
+
+	return true;
+}
+
+/*
+ * Keep a copy of the cells from the start of the row of cell start
+ * onwards, before they are laid out again.
+ * Returns the first cell of that row.
+ */
+static size_t tinyrl_frame_save(struct tinyrl_frame *screen,
+				const struct tinyrl_frame *frame, size_t start)
+{
+	size_t first = start;
+
+	while (first > 0 && frame->cells[first - 1].row == frame->cells[start].row)
+		first--;
+
+	screen->base = first < frame->count ? frame->cells[first].offset : frame->len;
+	screen->len = screen->base;
+	screen->count = 0;
+	screen->rows = 0;
+	if (first < frame->count) {
+		if (!tinyrl_frame_reserve(screen, frame->len - screen->base,
+					  frame->count - first))
+			return first;
+		memcpy(screen->text, frame->text + screen->base,
+		       frame->len - screen->base);
+		memcpy(screen->cells, frame->cells + first,
+		       (frame->count - first) * sizeof(*screen->cells));
+	}
+	screen->len = frame->len;
+	screen->count = frame->count - first;
+	screen->rows = frame->rows;
+	screen->width = frame->width;
+
+	return first;
+}
+
+static bool tinyrl_cell_equal(
+	const struct tinyrl_frame *a, const struct tinyrl_cell *a_cell,
+	const struct tinyrl_frame *b, const struct tinyrl_cell *b_cell)
+{
+	return a_cell->col == b_cell->col
+	    && a_cell->width == b_cell->width
+	    && a_cell->len == b_cell->len
+	    && memcmp(tinyrl_cell_text(a, a_cell), tinyrl_cell_text(b, b_cell),
+		      a_cell->len) == 0;
+}
+
+static size_t tinyrl_digits(size_t n)
+{
+	size_t digits = 1;
+
+	while (n >= 10) {
+		n /= 10;
+		digits++;
+	}
+	return digits;
+}
+
+/*
+ * The number of bytes needed to move the cursor along its row.
+ */
+static size_t tinyrl_cursor_cost(size_t from, size_t to)
+{
+	size_t relative;
+
+	if (from == to)
+		return 0;
+	if (to == 0)
+		return 1;
+	relative = 3 + tinyrl_digits(from < to ? to - from : from - to);
+	if (relative <= 4 + tinyrl_digits(to))
+		return relative;
+	return 4 + tinyrl_digits(to);
+}
+
+/*
+ * Move the cursor to a cell of the frame, relative to the first row.
+ * Rows which are not yet on the screen are reached with newlines.
+ */
+static void tinyrl_cursor_move(struct tinyrl *this, size_t row, size_t col)
+{
+	size_t count;
+
+	if (this->cursor_wrap) {
+		/*
+		 * After the last column is written some terminals leave the
+		 * cursor on it and others past it, so only move from the
+		 * start of the row.
+		 */
+		tinyrl_output_string(this, "\r");
+		this->cursor_col = 0;
+		this->cursor_wrap = false;
+	}
+
+	if (row < this->cursor_row) {
+		tinyrl_vt100_cursor_up(this, this->cursor_row - row);
+	} else if (row > this->cursor_row) {
+		count = row - this->cursor_row;
+		if (row >= this->screen_rows
+		    || count + tinyrl_cursor_cost(0, col)
+		       <= 3 + tinyrl_digits(count) + tinyrl_cursor_cost(this->cursor_col, col)) {
+			while (count--)
+				tinyrl_output_string(this, "\n");
+			this->cursor_col = 0;
+			if (row >= this->screen_rows)
+				this->screen_rows = row + 1;
 		} else {
-			*point = 0;
-			*end = 0;
-			*buffer = strdup("");
+			tinyrl_vt100_cursor_down(this, count);
 		}
 	}
+	this->cursor_row = row;
+
+	if (col == this->cursor_col)
+		return;
+	if (col == 0) {
+		tinyrl_output_string(this, "\r");
+	} else if (col > this->cursor_col
+		   && 3 + tinyrl_digits(col - this->cursor_col) <= 4 + tinyrl_digits(col)) {
+		tinyrl_vt100_cursor_forward(this, col - this->cursor_col);
+	} else if (col < this->cursor_col
+		   && 3 + tinyrl_digits(this->cursor_col - col) <= 4 + tinyrl_digits(col)) {
+		tinyrl_vt100_cursor_back(this, this->cursor_col - col);
+	} else {
+		tinyrl_output_string(this, "\r");
+		tinyrl_vt100_cursor_forward(this, col);
+	}
+	this->cursor_col = col;
 }
 
-static void tinyrl_string_wrap(
-	const char *s, size_t len, size_t row_width, size_t *row, size_t *col)
+static void tinyrl_cursor_print(struct tinyrl *this, size_t width,
+				const struct tinyrl_frame *frame,
+				const struct tinyrl_cell *cell)
 {
-	size_t point, next, width;
+	if (this->cursor_wrap && cell->row == this->cursor_row + 1 && cell->col == 0) {
+		/* printing it wraps to the next row */
+		this->cursor_row++;
+		this->cursor_col = 0;
+		this->cursor_wrap = false;
+		if (this->cursor_row >= this->screen_rows)
+			this->screen_rows = this->cursor_row + 1;
+	} else if (this->cursor_wrap || cell->row != this->cursor_row
+		   || cell->col != this->cursor_col) {
+		tinyrl_cursor_move(this, cell->row, cell->col);
+	}
+
+	tinyrl_output_write(this, tinyrl_cell_text(frame, cell), cell->len);
+	this->cursor_col += cell->width;
+	if (this->cursor_col >= width)
+		this->cursor_wrap = true;
+}
 
-	for (point = 0; point < len; point = next) {
-		width = utf8_grapheme_width(s, len, point, &next);
-		*col += width;
-		if (*col > row_width) {
-			*row += 1;
-			*col = width;
+/*
+ * Erase the end of a row, from where the new row ends to where the old
+ * one now does.
+ */
+static void tinyrl_display_erase(struct tinyrl *this, size_t row, size_t width,
+				 size_t new_end, size_t old_end)
+{
+	size_t i;
+
+	if (old_end <= new_end)
+		return;
+	tinyrl_cursor_move(this, row, new_end);
+	if (old_end - new_end < 4) {
+		for (i = new_end; i < old_end; i++)
+			tinyrl_output_string(this, " ");
+		this->cursor_col = old_end;
+		if (this->cursor_col >= width)
+			this->cursor_wrap = true;
+	} else {
+		tinyrl_vt100_erase_line_end(this);
+	}
+}
+
+static size_t tinyrl_cells_len(const struct tinyrl_cell *cells, size_t count)
+{
+	size_t len = 0;
+
+	while (count--)
+		len += cells++->len;
+	return len;
+}
+
+/*
+ * Find the cell of the frame which starts at the given offset.
+ */
+static const struct tinyrl_cell *
+tinyrl_frame_find(const struct tinyrl_frame *frame, size_t offset)
+{
+	size_t i = tinyrl_frame_search(frame, offset);
+
+	if (i < frame->count && frame->cells[i].offset == offset)
+		return &frame->cells[i];
+	return NULL;
+}
+
+/*
+ * Update a row by shifting the cells which stay on it with insert or
+ * delete character sequences, when that is cheaper than rewriting
+ * them.  Only text in the common suffix of the old and new frames is
+ * shifted, and suffix is its length.
+ * Returns false if the row has not been updated.
+ */
+static bool tinyrl_display_shift(struct tinyrl *this, size_t row, size_t width,
+				 size_t suffix, size_t head, size_t rewrite,
+				 const struct tinyrl_cell *old_cells, size_t old_count,
+				 const struct tinyrl_cell *new_cells, size_t new_count)
+{
+	const struct tinyrl_cell *old, *first = NULL;
+	size_t start, end, i, shift, cost;
+	size_t old_end, new_end;
+	long delta = 0;
+
+	/* find the run of cells which are only moved along the row */
+	for (start = head; start < new_count; start++) {
+		if (new_cells[start].offset + suffix < this->frame.len)
+			continue;
+		old = tinyrl_frame_find(&this->screen, new_cells[start].offset
+					- this->frame.len + this->screen.len);
+		if (old && old->row == row && old->col != new_cells[start].col) {
+			first = old;
+			delta = (long)new_cells[start].col - (long)old->col;
+			break;
 		}
 	}
+	if (!first)
+		return false;
+
+	for (end = start + 1, old = first + 1; end < new_count; end++, old++) {
+		if (old >= old_cells + old_count
+		    || (long)new_cells[end].col - (long)old->col != delta
+		    || old->len != new_cells[end].len
+		    || memcmp(tinyrl_cell_text(&this->screen, old),
+			      tinyrl_cell_text(&this->frame, &new_cells[end]), old->len) != 0)
+			break;
+	}
+
+	/* unchanged cells which an insert moves must be rewritten */
+	if (delta > 0)
+		while (head > 0 && new_cells[head - 1].col >= first->col)
+			head--;
+
+	shift = delta > 0 ? delta : -delta;
+	cost = tinyrl_cells_len(new_cells + head, start - head)
+	       + tinyrl_cells_len(new_cells + end, new_count - end)
+	       + 3 * (3 + tinyrl_digits(shift));
+	if (cost >= rewrite)
+		return false;
+
+	old_end = old_count ? old_cells[old_count - 1].col + old_cells[old_count - 1].width : 0;
+	new_end = new_cells[new_count - 1].col + new_cells[new_count - 1].width;
+
+	if (delta > 0) {
+		/* open a gap in front of the run, and fill it */
+		tinyrl_cursor_move(this, row, first->col);
+		tinyrl_vt100_insert_chars(this, shift);
+		old_end += shift;
+		if (old_end > width)
+			old_end = width;
+		for (i = head; i < start; i++)
+			tinyrl_cursor_print(this, width, &this->frame, &new_cells[i]);
+	} else {
+		/* rewrite up to the run, and close the gap after it */
+		for (i = head; i < start; i++)
+			tinyrl_cursor_print(this, width, &this->frame, &new_cells[i]);
+		tinyrl_cursor_move(this, row, new_cells[start].col);
+		tinyrl_vt100_delete_chars(this, shift);
+		old_end -= shift;
+	}
+
+	for (i = end; i < new_count; i++)
+		tinyrl_cursor_print(this, width, &this->frame, &new_cells[i]);
+	tinyrl_display_erase(this, row, width, new_end, old_end);
+
+	return true;
+}
+
+/*
+ * Update a row of the screen, rewriting only the cells between the
+ * ones which are unchanged at its start and at its end.
+ */
+static void tinyrl_display_row(struct tinyrl *this, size_t row, size_t width,
+			       size_t suffix,
+			       const struct tinyrl_cell *old_cells, size_t old_count,
+			       const struct tinyrl_cell *new_cells, size_t new_count)
+{
+	size_t head, tail, i;
+	size_t old_end, new_end;
+
+	for (head = 0; head < old_count && head < new_count; head++)
+		if (!tinyrl_cell_equal(&this->screen, &old_cells[head],
+				       &this->frame, &new_cells[head]))
+			break;
+	if (head == old_count && head == new_count)
+		return;
+
+	if (!new_count) {
+		tinyrl_cursor_move(this, row, this->cursor_wrap ? 0 : this->cursor_col);
+		tinyrl_vt100_erase_line(this);
+		return;
+	}
+
+	for (tail = 0; tail < old_count - head && tail < new_count - head; tail++)
+		if (!tinyrl_cell_equal(&this->screen, &old_cells[old_count - 1 - tail],
+				       &this->frame, &new_cells[new_count - 1 - tail]))
+			break;
+
+	if (suffix && tinyrl_display_shift(this, row, width, suffix, head,
+					   tinyrl_cells_len(new_cells + head, new_count - tail - head),
+					   old_cells, old_count, new_cells, new_count))
+		return;
+
+	for (i = head; i < new_count - tail; i++)
+		tinyrl_cursor_print(this, width, &this->frame, &new_cells[i]);
+	if (tail)
+		return;
+
+	/* erase what is left of the old row */
+	old_end = old_count ? old_cells[old_count - 1].col + old_cells[old_count - 1].width : 0;
+	new_end = new_cells[new_count - 1].col + new_cells[new_count - 1].width;
+	tinyrl_display_erase(this, row, width, new_end, old_end);
+}
+
+static size_t tinyrl_query_width(const struct tinyrl *this)
+{
+	struct winsize ws;
+
+	if (this->ostream
+	    && ioctl(fileno(this->ostream), TIOCGWINSZ, &ws) != -1 && ws.ws_col)
+		return ws.ws_col;
+
+	return 80;
+}
+
+/*
+ * Get the terminal width, only asking the terminal again once it has
+ * been resized.
+ */
+static size_t tinyrl_width(struct tinyrl *this)
+{
+	if (!this->width_fixed
+	    && (!this->width || this->width_resizes != tinyrl_resizes)) {
+		this->width_resizes = tinyrl_resizes;
+		this->width = tinyrl_query_width(this);
+	}
+	return this->width;
+}
+
+/* monotonic time in milliseconds */
+static long long tinyrl_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Compose the changes to the display since the last frame.
+ */
+static void tinyrl_display(struct tinyrl *this)
+{
+	size_t width, point, rows, row, suffix, limit;
+	size_t prompt_len, from, start, first;
+	size_t old_start, old_end, new_start, new_end;
+	bool scroll;
+
+	width = tinyrl_width(this);
+	scroll = this->echo_enabled && this->scroll_threshold
+		 && this->end > this->scroll_threshold;
+
+	if (this->displayed && this->frame.width != width) {
+		/* the terminal may have rewrapped the line, so start again
+		 * from the row it began on */
+		if (this->cursor_wrap)
+			this->cursor_col--;
+		tinyrl_output_string(this, "\r");
+		if (this->cursor_row)
+			tinyrl_vt100_cursor_up(this, this->cursor_row);
+		tinyrl_vt100_erase_down(this);
+		this->displayed = false;
+	}
+
+	/* find the first text which may have changed */
+	prompt_len = strlen(this->prompt);
+	if (!this->displayed) {
+		/* nothing is shown yet, and the cursor is where it starts */
+		from = 0;
+		this->frame.len = 0;
+		this->frame.count = 0;
+		this->screen_rows = 1;
+		this->cursor_row = 0;
+		this->cursor_col = 0;
+		this->cursor_wrap = false;
+	} else if (!this->echo_enabled || scroll || this->scrolled
+		   || this->frame.len < prompt_len
+		   || memcmp(this->frame.text, this->prompt, prompt_len) != 0) {
+		from = 0;
+	} else if (this->dirty != SIZE_MAX) {
+		from = prompt_len + this->dirty;
+	} else {
+		from = this->frame.len;
+	}
+
+	/* start laying out again from the grapheme before the change, as
+	 * the change may join on to it */
+	start = tinyrl_frame_search(&this->frame, from);
+	if (start)
+		start--;
+	first = tinyrl_frame_save(&this->screen, &this->frame, start);
+	if (!this->displayed)
+		this->screen.rows = 0;
+	row = first < this->frame.count ? this->frame.cells[first].row : 0;
+
+	if (!(scroll ? tinyrl_view_print(this, &this->frame, width, &point)
+	      : tinyrl_internal_print(this, &this->frame, from, &point))
+	    || !tinyrl_frame_layout(&this->frame, width, start))
+		return;
+	this->scrolled = scroll;
+	tinyrl_frame_point(&this->frame, point);
+
+	/* text at the end which is unchanged may only need to be moved */
+	suffix = 0;
+	if (this->insert_delete) {
+		limit = this->frame.len < this->screen.len ? this->frame.len : this->screen.len;
+		limit = limit > from ? limit - from : 0;
+		while (suffix < limit
+		       && this->screen.text[this->screen.len - this->screen.base - 1 - suffix]
+			  == this->frame.text[this->frame.len - 1 - suffix])
+			suffix++;
+	}
+
+	rows = this->frame.rows > this->screen.rows ? this->frame.rows : this->screen.rows;
+	old_end = 0;
+	new_end = first;
+	for (; row < rows; row++) {
+		old_start = old_end;
+		while (old_end < this->screen.count && this->screen.cells[old_end].row == row)
+			old_end++;
+		new_start = new_end;
+		while (new_end < this->frame.count && this->frame.cells[new_end].row == row)
+			new_end++;
+		tinyrl_display_row(this, row, width, suffix,
+				   this->screen.cells + old_start, old_end - old_start,
+				   this->frame.cells + new_start, new_end - new_start);
+	}
+
+	/* move cursor to point */
+	tinyrl_cursor_move(this, this->frame.point_row, this->frame.point_col);
+
+	this->displayed = true;
+	this->dirty = SIZE_MAX;
+	this->redisplay_pending = false;
+	this->output_stats.frames++;
+	if (this->typeahead)
+		this->redisplay_time = tinyrl_time();
 }
 
 void tinyrl_redisplay(struct tinyrl *this)
 {
-	size_t width;
-	size_t prompt_row, prompt_col;
-	size_t row, col;
-	size_t point_row, point_col;
-	size_t i;
-	size_t next_len, keep_len, keep_row, keep_col;
-	size_t point, end;
-	char *buffer;
+	tinyrl_display(this);
+	tinyrl_flush(this);
+}
+
+struct tinyrl *tinyrl_new(FILE * instream, FILE * outstream)
+{
+	struct tinyrl *this = NULL;
+
+	this = malloc(sizeof(*this));
+	if (NULL != this) {
+		tinyrl_init(this, instream, outstream);
+	}
+
+	return this;
+}
+
+struct tinyrl *tinyrl_session_new(void)
+{
+	struct tinyrl *this;
+
+	this = tinyrl_new(NULL, NULL);
+	if (NULL != this) {
+		/* no line is read until tinyrl_feed_start() */
+		this->done = true;
+	}
 
-	width = tinyrl__get_width(this);
+	return this;
+}
 
-	prompt_row = 0;
-	prompt_col = 0;
-	tinyrl_string_wrap(this->prompt, strlen(this->prompt), width, &prompt_row, &prompt_col);
+/* Call the handler for the longest matching prefix of the key sequence.
+ * Note: if there is only a partial match, then the rest of the key is
+ * discarded.
+ */
+static void tinyrl_handle_key(struct tinyrl *this, char *key, int key_len)
+{
+	const struct tinyrl_keymap_entry *entry;
+	tinyrl_key_func_t *handler;
+	void *context;
+	int i;
 
-	tinyrl_internal_print(this, &buffer, &point, &end);
-	if (!buffer)
+	/* a grab sees every key first */
+	if (this->grab && this->grab(this->grab_context, key))
 		return;
 
-	/* erase changed portion of previous line */
-	if (this->last_buffer) {
-		/* find out how much to keep */
-		keep_len = 0;
-		for (;;) {
-			if (keep_len >= end)
+	handler = NULL;
+	context = NULL;
+	entry = tinyrl_keymap_root(this, key[0]);
+	for (i = 1; ; i++) {
+		if (entry->handler) {
+			handler = entry->handler;
+			context = entry->context == SELF ? this : entry->context;
+		}
+		if (i >= key_len || !entry->keymap)
+			break;
+		entry = tinyrl_keymap_find(entry->keymap, key[i]);
+		if (!entry)
+			break;
+	}
+
+	if (!handler || !handler(context, key)) {
+		/* an issue has occured */
+		tinyrl_ding(this);
+	}
+}
+
+/*
+ * Insert the run of pending characters which are bound to the default
+ * handler with a single insert, so that pasted text is redisplayed once
+ * rather than after every key.  The run ends at the first key that needs
+ * its own handler, or when the input is drained.
+ * Returns false if the next pending key is not a plain insertion.
+ */
+static bool tinyrl_insert_pending(struct tinyrl *this)
+{
+	const struct tinyrl_keymap_entry *entry;
+	const char *text;
+	size_t len, char_len, pending;
+	unsigned char c;
+	bool result = false;
+	bool truncated;
+
+	/* a grab needs to see each key */
+	if (this->grab)
+		return false;
+
+	do {
+		text = this->input + this->input_start;
+		pending = tinyrl_input_pending(this);
+		for (len = 0; len < pending; len += char_len) {
+			c = text[len];
+			entry = tinyrl_keymap_root(this, c);
+			if (entry->handler != tinyrl_key_default || entry->keymap
+			    || (entry->context != SELF && entry->context != this))
 				break;
-			next_len = utf8_grapheme_next(buffer, end, keep_len);
-			if (next_len > this->last_end)
+			char_len = utf8_char_len(c);
+			if (!char_len || len + char_len > pending
+			    || utf8_char_decode(text + len, char_len, NULL) != char_len)
 				break;
-			if (memcmp(buffer + keep_len, this->last_buffer + keep_len, next_len - keep_len) != 0)
+		}
+
+		if (!len || !tinyrl_insert_text_len(this, text, len))
+			break;
+		this->input_start += len;
+		result = true;
+
+		/* a full buffer means the paste probably continues */
+		truncated = this->input_end == this->input_size;
+	} while (!tinyrl_input_pending(this) && truncated
+		 && tinyrl_input_wait(this, 0));
+
+	return result;
+}
+
+/*
+ * Handle the next key, or run of keys, from the pending input.
+ * Returns 1 if input was consumed, 0 if more input is needed, or -1 if
+ * the input is invalid.
+ */
+static int tinyrl_handle_input(struct tinyrl *this)
+{
+	char key[KEY_SIZE];
+	int key_len;
+
+	if (this->pasting) {
+		if (!tinyrl_insert_paste(this))
+			return 0;
+		this->redisplay_pending = true;
+		return 1;
+	}
+
+	/* insert any pasted text in one go */
+	if (tinyrl_insert_pending(this)) {
+		this->redisplay_pending = true;
+		return 1;
+	}
+
+	key_len = tinyrl_getkey(this, key);
+	if (key_len <= 0)
+		return key_len;
+
+	/* call the handler for this key */
+	tinyrl_handle_key(this, key, key_len);
+	this->redisplay_pending = !this->done;
+
+	if (this->done) {
+		/*
+		 * If the last character in the line (other than 
+		 * the null) is a space remove it.
+		 */
+		if (this->end
+		    && isspace(tinyrl_line_text(this)[this->end - 1])) {
+			tinyrl_delete_text(this, this->end - 1,
+					   this->end);
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * In typeahead mode the redisplay is skipped while more keys are
+ * already waiting, as long as the display is no older than the
+ * maximum latency.
+ */
+static bool tinyrl_defer_redisplay(struct tinyrl *this)
+{
+	if (!this->typeahead)
+		return false;
+	if (!tinyrl_input_pending(this) && !tinyrl_input_wait(this, 0))
+		return false;
+
+	return tinyrl_time() - this->redisplay_time < this->typeahead_latency;
+}
+
+static void tinyrl_readtty(struct tinyrl *this)
+{
+	struct termios default_termios;
+	size_t pending;
+	int status;
+
+	tty_set_raw_mode(this->istream, &default_termios);
+	if (this->bracketed_paste)
+		tinyrl_output_string(this, "\x1b[?2004h");
+
+	tinyrl_reset_line_state(this);
+
+	while (!this->done) {
+		/* update the display, unless more keys are on the way */
+		if (this->redisplay_pending && !this->pasting
+		    && !tinyrl_defer_redisplay(this))
+			tinyrl_redisplay(this);
+
+		/*
+		 * Handle a key, reading more input as needed.  If nothing
+		 * more can be read then the input has ended, even if part of
+		 * a key is left over.
+		 */
+		while ((status = tinyrl_handle_input(this)) == 0) {
+			pending = tinyrl_input_pending(this);
+			if (tinyrl_input_fill(this) == pending)
 				break;
-			keep_len = next_len;
 		}
 
-		keep_row = prompt_row;
-		keep_col = prompt_col;
-		tinyrl_string_wrap(buffer, keep_len, width, &keep_row, &keep_col);
-		if (keep_len > 0 && keep_col == width) {
-			/* never keep an empty last line, so that we can
-			 * position the cursor correctly */
-			keep_len = utf8_grapheme_prev(buffer, end, keep_len);
-			keep_row = prompt_row;
-			keep_col = prompt_col;
-			tinyrl_string_wrap(buffer, keep_len, width, &keep_row, &keep_col);
+		/* has the input stream terminated? */
+		if (status <= 0) {
+			/* time to finish the session */
+			this->done = true;
+			this->line = NULL;
 		}
+	}
+
+	if (this->bracketed_paste) {
+		tinyrl_output_string(this, "\x1b[?2004l");
+		tinyrl_flush(this);
+	}
+	tty_restore_mode(this->istream, &default_termios);
+}
+
+/*
+ * Reallocate the line buffer to hold size characters, keeping the text
+ * after the gap at the end.
+ */
+static bool tinyrl_resize_line_buffer(struct tinyrl *this, size_t size)
+{
+	char *new_buffer;
+	size_t tail = 0;
+
+	if (this->line == this->buffer)
+		tail = this->end - this->gap;
+
+	/* leave space for terminator */
+	new_buffer = realloc(this->buffer, size + 1);
+	if (NULL == new_buffer)
+		return false;
 
-		/* move cursor to the start of the last displayed row */
-		tinyrl_printf(this, "\r");
-		if (this->last_row > this->last_point_row) {
-			tinyrl_vt100_cursor_down(this, this->last_row - this->last_point_row);
-		} else if (this->last_row < this->last_point_row) {
-			tinyrl_vt100_cursor_up(this, this->last_point_row - this->last_row);
+	memmove(new_buffer + size - tail, new_buffer + this->buffer_size - tail, tail);
+	new_buffer[size] = '\0';
+	this->buffer_size = size;
+	this->line = this->buffer = new_buffer;
+	return true;
+}
+
+/*
+ * Ensure that buffer has enough space to hold len characters,
+ * possibly reallocating it if necessary. The function returns true
+ * if the line is successfully extended, false if not.
+ */
+static bool tinyrl_extend_line_buffer(struct tinyrl *this, unsigned len)
+{
+	bool result = true;
+
+	if (this->max_line_length && len >= this->max_line_length) {
+		/* the buffer may be bigger, as it is kept between lines */
+		tinyrl_ding(this);
+		result = false;
+	} else if (this->buffer_size < len) {
+		size_t new_len = len;
+
+		/* 
+		 * What we do depends on whether we are limited by
+		 * memory or a user imposed limit.
+		 */
+
+		if (this->max_line_length == 0) {
+			if (new_len < 2 * this->buffer_size + 10) {
+				/*
+				 * make sure we don't realloc too often, even
+				 * when a long line is pasted
+				 */
+				new_len = 2 * this->buffer_size + 10;
+			}
+		} else {
+			/* Just reallocate once to the max size */
+			new_len = this->max_line_length - 1;
 		}
 
-		/* erase the rows we aren't keeping */
-		for (i = keep_row; i < this->last_row; i++) {
-			tinyrl_vt100_erase_line(this);
-			tinyrl_vt100_cursor_up(this, 1);
+		if (!tinyrl_resize_line_buffer(this, new_len)) {
+			tinyrl_ding(this);
+			result = false;
 		}
-
-		/* partially erase the last kept row */
-		if (keep_col)
-			tinyrl_vt100_cursor_forward(this, keep_col);
-		tinyrl_vt100_erase_line_end(this);
-	} else {
-		keep_len = 0;
-		tinyrl_printf(this, "%s", this->prompt);
 	}
+	return result;
+}
 
-	tinyrl_printf(this, "%s", buffer + keep_len);
+/*
+ * Find the next line in the input buffer, reading more input as needed.
+ * Returns NULL if there is no more input.
+ */
+static char *tinyrl_input_line(struct tinyrl *this, size_t *len, bool *newline)
+{
+	size_t pending, scanned = 0;
+	char *s, *nl;
 
-	/* move cursor to point */
-	row = prompt_row;
-	col = prompt_col;
-	tinyrl_string_wrap(buffer, end, width, &row, &col);
-
-	point_row = prompt_row;
-	point_col = prompt_col;
-	tinyrl_string_wrap(buffer, point, width, &point_row, &point_col);
-	if (point_col == width
-	    || (point < end && point_col + utf8_grapheme_width(buffer, end, point, NULL) > width)) {
-		point_row++;
-		point_col = 0;
-	}
-
-	if (row < point_row) {
-                /* if the text is a whole number of lines, then the
-                 * cursor will still be at the end of the last line,
-		 * so move it to the start of the next  */
-		tinyrl_printf(this, "\n");
-	}
-	if (end > point) {
-		if (row > point_row) {
-			tinyrl_vt100_cursor_up(this, row - point_row);
+	for (;;) {
+		pending = tinyrl_input_pending(this);
+		s = this->input + this->input_start;
+		nl = memchr(s + scanned, '\n', pending - scanned);
+		if (nl) {
+			*len = nl - s;
+			*newline = true;
+			this->input_start += *len + 1;
+			return s;
 		}
-		tinyrl_printf(this, "\r");
-		if (point_col) {
-			tinyrl_vt100_cursor_forward(this, point_col);
+		if (!tinyrl_input_reserve(this, this->input_size / 4))
+			return NULL;
+		scanned = pending;
+		if (tinyrl_input_fill(this) == pending) {
+			/* the last line may not have a newline */
+			s = this->input + this->input_start;
+			*len = pending;
+			*newline = false;
+			this->input_start += *len;
+			return s;
 		}
 	}
+}
+
+/*
+ * Find the next line in a mapped script.
+ * Returns NULL if there is no more input.
+ */
+static const char *tinyrl_script_line(struct tinyrl *this, size_t *len,
+				      bool *newline)
+{
+	const char *s = this->script + this->script_pos;
+	const char *nl;
+	size_t done;
+
+	/* let go of the pages of the lines which have been handed over */
+	done = this->script_pos & ~(size_t)(SCRIPT_RELEASE - 1);
+	if (done > this->script_released) {
+		madvise(this->script + this->script_released,
+			done - this->script_released, MADV_DONTNEED);
+		this->script_released = done;
+	}
 
-	free(this->last_buffer);
-	this->last_buffer = buffer;
-	this->last_end = end;
-	this->last_row = row;
-	this->last_point_row = point_row;
+	if (this->script_pos == this->script_size)
+		return NULL;
 
-	fflush(this->ostream);
+	nl = memchr(s, '\n', this->script_size - this->script_pos);
+	*newline = nl != NULL;
+	*len = nl ? (size_t)(nl - s) : this->script_size - this->script_pos;
+	this->script_pos += *len + *newline;
+
+	return s;
 }
 
-struct tinyrl *tinyrl_new(FILE * instream, FILE * outstream)
+/*
+ * Terminate a line found by tinyrl_readraw().  A line in the input
+ * buffer is terminated in place, but a mapped script can't be written
+ * to, so the line is copied into the line buffer.  As with lines which
+ * are read, its length isn't limited.
+ */
+static const char *tinyrl_raw_terminate(struct tinyrl *this, const char *s,
+					size_t len)
 {
-	struct tinyrl *this = NULL;
-
-	this = malloc(sizeof(*this));
-	if (NULL != this) {
-		tinyrl_init(this, instream, outstream);
+	if (!this->script) {
+		this->input[s - this->input + len] = '\0';
+		return s;
 	}
 
-	return this;
+	if (this->buffer_size < len && !tinyrl_resize_line_buffer(this, len))
+		return NULL;
+	memcpy(this->buffer, s, len);
+	this->buffer[len] = '\0';
+	this->gap = len;
+	return this->buffer;
 }
 
-/* Call the handler for the longest matching key sequence.
- * Note: if there is a partial match, then the extra keys are discarded.  This
- * shouldn't matter in practice.
+/*
+ * Read a line from a stream which isn't a terminal, such as a script.
+ * The line is lent from where it was read, either the input buffer
+ * which is filled a block at a time or a mapped file, and stays there
+ * until the next line is read.  It is only terminated if asked, which
+ * may mean copying it.  As with fgets() the line ends at a newline,
+ * though anything from a carriage return on is dropped, as is any
+ * leading whitespace.
  */
-static void tinyrl_handle_key(struct tinyrl *this, char *key, int key_len)
+static const char *tinyrl_readraw(struct tinyrl *this, size_t *len,
+				  bool terminate)
 {
-	struct tinyrl_keymap *keymap;
-	tinyrl_key_func_t *handler;
-	void *context;
-	unsigned char c;
-	int i;
+	const char *cr;
+	bool newline = false;
+	size_t point;
+	const char *s;
 
-	handler = NULL;
-	context = NULL;
-	keymap = this->keymap;
-	i = 0;
-	for (;;) {
-		c = key[i];
-		if (keymap->handler[c]) {
-			handler = keymap->handler[c];
-			context = keymap->context[c];
+	/* manually reset the line state without redisplaying */
+	this->displayed = false;
+
+	if (this->script)
+		s = tinyrl_script_line(this, len, &newline);
+	else
+		s = tinyrl_input_line(this, len, &newline);
+
+	if (s) {
+		cr = memchr(s, '\r', *len);
+		if (cr)
+			*len = cr - s;
+		while (*len && isspace((unsigned char)*s)) {
+			s++;
+			(*len)--;
 		}
-		keymap = keymap->keymap[c];
-		if (!keymap)
-			break;
+	}
 
-		i++;
-		if (i >= key_len) {
-			key_len = tinyrl_getchar_nonblock(this, key);
-			if (key_len <= 0)
-				break;
-			i = 0;
+	if (!newline && (!s || !*len)) {
+		/* time to finish the session */
+		s = NULL;
+		*len = 0;
+	} else if (terminate) {
+		s = tinyrl_raw_terminate(this, s, *len);
+		if (!s)
+			*len = 0;
+	}
+
+	this->line = s;
+	this->point = this->end = *len;
+
+	/* echo the command to the output stream, in one write */
+	if (this->script_echo) {
+		if (*len && tinyrl_internal_print(this, &this->frame, 0, &point))
+			tinyrl_output_write(this, this->frame.text, this->frame.len);
+		if (s)
+			tinyrl_output_string(this, "\n");
+		if (!*len) {
+			/* make sure we're not left on a prompt line */
+			tinyrl_output_string(this, "\n");
 		}
+		tinyrl_flush(this);
 	}
+	this->done = true;
 
-	if (!handler || !handler(context, key)) {
-		/* an issue has occured */
-		tinyrl_ding(this);
+	return s;
+}
+
+/*
+ * Let go of the line once it has been handed over, keeping our internal
+ * buffer for the next line unless it grew big.
+ */
+static void tinyrl_line_release(struct tinyrl *this)
+{
+	this->end = this->gap = 0;
+	if (this->max_buffer_size && this->buffer_size > this->max_buffer_size)
+		(void)tinyrl_resize_line_buffer(this, this->max_buffer_size);
+	if (this->buffer_size > this->max_buffer_size || !this->max_buffer_size) {
+		free(this->buffer);
+		this->buffer = NULL;
+		this->buffer_size = 0;
 	}
+	this->line = NULL;
+	this->feed_ready = false;
 }
 
-static void tinyrl_readtty(struct tinyrl *this)
+static void tinyrl_readline_start(struct tinyrl *this, const char *prompt)
 {
-	struct termios default_termios;
-	char key[5];
-	int key_len;
+	/* initialise for reading a line */
+	tinyrl_line_release(this);
+	this->done = false;
+	this->point = 0;
+	if (!this->buffer) {
+		this->buffer = strdup("");
+		this->buffer_size = strlen(this->buffer);
+	}
+	this->line = this->buffer;
+	this->prompt = prompt;
+	this->grab = NULL;
+	this->pasting = false;
+	this->dirty = 0;
+	this->view = 0;
+
+	/* check the width once per line, in case resizes aren't notified */
+	if (!this->width_fixed)
+		this->width = 0;
+}
 
-	tty_set_raw_mode(this->istream, &default_termios);
+/*
+ * Finish reading a line, leaving it in our internal buffer until the
+ * next line is started.  Returns NULL at the end of the input.
+ */
+static const char *tinyrl_readline_finish(struct tinyrl *this, size_t *len)
+{
+	const char *result = NULL;
+
+	*len = 0;
+	if (this->line) {
+		/* a history entry may not outlive the line */
+		changed_line(this);
+		result = tinyrl_line_text(this);
+		*len = this->end;
+	}
 
-	tinyrl_reset_line_state(this);
+	if (!*len) {
+		/* make sure we're not left on a prompt line */
+		tinyrl_crlf(this);
+	}
+	return result;
+}
 
-	while (!this->done) {
-		/* update the display */
-		tinyrl_redisplay(this);
+static const char *tinyrl_read(struct tinyrl *this, const char *prompt,
+			       size_t *len, bool terminate)
+{
+	assert(this->istream);
 
-		/* get a key */
-		key_len = tinyrl_getchar(this, key);
+	tinyrl_readline_start(this, prompt);
 
-		/* has the input stream terminated? */
-		if (key_len > 0) {
-			/* call the handler for this key */
-			tinyrl_handle_key(this, key, key_len);
+	if (!this->isatty)
+		return tinyrl_readraw(this, len, terminate);
 
-			if (this->done) {
-				/*
-				 * If the last character in the line (other than 
-				 * the null) is a space remove it.
-				 */
-				if (this->end
-				    && isspace(this-> line[this->end - 1])) {
-					tinyrl_delete_text(this, this->end - 1,
-							   this->end);
-				}
-			}
-		} else {
-			/* time to finish the session */
-			this->done = true;
-			this->line = NULL;
-		}
-	}
+	tinyrl_readtty(this);
+	return tinyrl_readline_finish(this, len);
+}
 
-	tty_restore_mode(this->istream, &default_termios);
+const char *tinyrl_readline_view(struct tinyrl *this, const char *prompt,
+				 size_t *len)
+{
+	return tinyrl_read(this, prompt, len, true);
 }
 
-static void tinyrl_readraw(struct tinyrl *this)
+char *tinyrl_readline(struct tinyrl *this, const char *prompt)
 {
-	/* This is a non-interactive set of commands */
-	char *s = 0, buffer[80];
-	size_t len = sizeof(buffer);
+	const char *line;
+	char *result;
+	size_t len;
 
-	/* manually reset the line state without redisplaying */
-	free(this->last_buffer);
-	this->last_buffer = NULL;
-
-	while ((sizeof(buffer) == len) &&
-	       (s = fgets(buffer, sizeof(buffer), this->istream))) {
-		char *p;
-		/* strip any spurious '\r' or '\n' */
-		p = strchr(buffer, '\r');
-		if (NULL == p) {
-			p = strchr(buffer, '\n');
-		}
-		if (NULL != p) {
-			*p = '\0';
-		}
-		/* skip any whitespace at the beginning of the line */
-		if (0 == this->point) {
-			while (*s && isspace(*s)) {
-				s++;
+	/* copy the line straight from where it was read for the client */
+	line = tinyrl_read(this, prompt, &len, false);
+	result = line ? strndup(line, len) : NULL;
+	tinyrl_line_release(this);
+
+	return result;
+}
+
+/*
+ * Handle as much of the fed input as possible.  The line is redisplayed
+ * once, after all of it has been handled.
+ */
+static int tinyrl_feed_input(struct tinyrl *this)
+{
+	int result = 0;
+	int status;
+	size_t len;
+
+	if (!this->done) {
+		while (!this->done) {
+			status = tinyrl_handle_input(this);
+			if (status == 0 && this->input_eof)
+				status = -1;
+			if (status == 0)
+				break;
+			if (status < 0) {
+				/* time to finish the session */
+				this->done = true;
+				this->line = NULL;
 			}
 		}
-		if (*s) {
-			/* append this string to the input buffer */
-			(void)tinyrl_insert_text(this, s);
-			/* echo the command to the output stream */
+
+		if (this->done) {
+			this->feed_ready = tinyrl_readline_finish(this, &len) != NULL;
+			result |= this->feed_ready ? TINYRL_FEED_LINE : TINYRL_FEED_EOF;
+		} else if (!this->pasting
+			   && (this->redisplay_pending || !this->displayed)) {
 			tinyrl_redisplay(this);
 		}
-		len = strlen(buffer) + 1;	/* account for the '\0' */
+	} else if (this->input_eof && !this->feed_ready) {
+		result |= TINYRL_FEED_EOF;
 	}
 
-	/*
-	 * check against fgets returning null as either error or end of file.
-	 * This is a measure to stop potential task spin on encountering an
-	 * error from fgets.
-	 */
-	if (s == NULL || (this->line[0] == '\0' && feof(this->istream))) {
-		/* time to finish the session */
-		this->line = NULL;
-	} else {
-		tinyrl_crlf(this);
-		this->done = true;
-	}
+	if (this->output_end > this->output_start)
+		result |= TINYRL_FEED_OUTPUT;
+
+	return result;
 }
 
-char *tinyrl_readline(struct tinyrl *this, const char *prompt)
+int tinyrl_feed_start(struct tinyrl *this, const char *prompt)
 {
-	char *result;
+	tinyrl_readline_start(this, prompt);
 
-	/* initialise for reading a line */
-	this->done = false;
-	this->point = 0;
-	this->end = 0;
-	this->buffer = strdup("");
-	this->buffer_size = strlen(this->buffer);
-	this->line = this->buffer;
-	this->prompt = prompt;
+	/* start from scratch, the line is displayed once input is handled */
+	this->displayed = false;
+
+	return tinyrl_feed_input(this);
+}
 
-	if (this->isatty) {
-		tinyrl_readtty(this);
+int tinyrl_feed(struct tinyrl *this, const char *bytes, size_t len)
+{
+	if (len) {
+		if (!tinyrl_input_append(this, bytes, len))
+			return TINYRL_FEED_EOF;
+		this->input_expired = false;
 	} else {
-		tinyrl_readraw(this);
+		/* decode whatever is left */
+		this->input_eof = true;
+		this->input_expired = true;
 	}
 
-	/*
-	 * duplicate the string for return to the client 
-	 * we have to duplicate as we may be referencing a
-	 * history entry or our internal buffer
-	 */
-	result = this->line ? strdup(this->line) : NULL;
+	return tinyrl_feed_input(this);
+}
 
-	/* free our internal buffer */
-	free(this->buffer);
-	this->buffer = NULL;
+int tinyrl_feed_timeout(struct tinyrl *this)
+{
+	this->input_expired = true;
 
-	if ((NULL == result) || '\0' == *result) {
-		/* make sure we're not left on a prompt line */
-		tinyrl_crlf(this);
-	}
-	return result;
+	return tinyrl_feed_input(this);
 }
 
-/*
- * Ensure that buffer has enough space to hold len characters,
- * possibly reallocating it if necessary. The function returns true
- * if the line is successfully extended, false if not.
- */
-static bool tinyrl_extend_line_buffer(struct tinyrl *this, unsigned len)
+char *tinyrl_feed_line(struct tinyrl *this)
 {
-	bool result = true;
-	if (this->buffer_size < len) {
-		char *new_buffer;
-		size_t new_len = len;
+	const char *line;
+	size_t len;
 
-		/* 
-		 * What we do depends on whether we are limited by
-		 * memory or a user imposed limit.
-		 */
+	line = tinyrl_feed_line_view(this, &len);
+	return line ? strdup(line) : NULL;
+}
 
-		if (this->max_line_length == 0) {
-			if (new_len < this->buffer_size + 10) {
-				/* make sure we don't realloc too often */
-				new_len = this->buffer_size + 10;
-			}
-			/* leave space for terminator */
-			new_buffer = realloc(this->buffer, new_len + 1);
-
-			if (NULL == new_buffer) {
-				tinyrl_ding(this);
-				result = false;
-			} else {
-				this->buffer_size = new_len;
-				this->line = this->buffer = new_buffer;
-				result = true;
-			}
-		} else {
-			if (new_len < this->max_line_length) {
-
-				/* Just reallocate once to the max size */
-				new_buffer =
-					realloc(this->buffer,
-						this->max_line_length);
-
-				if (NULL == new_buffer) {
-					tinyrl_ding(this);
-					result = false;
-				} else {
-					this->buffer_size =
-						this->max_line_length - 1;
-					this->line = this->buffer = new_buffer;
-					result = true;
-				}
-			} else {
-				tinyrl_ding(this);
-				result = false;
-			}
-		}
+const char *tinyrl_feed_line_view(struct tinyrl *this, size_t *len)
+{
+	*len = 0;
+	if (!this->feed_ready)
+		return NULL;
+
+	this->feed_ready = false;
+	*len = this->end;
+	return this->line;
+}
+
+void tinyrl_get_output_stats(const struct tinyrl *this,
+			     struct tinyrl_output_stats *stats)
+{
+	*stats = this->output_stats;
+}
+
+const char *tinyrl_output(const struct tinyrl *this, size_t *len)
+{
+	*len = this->output_end - this->output_start;
+	return this->output + this->output_start;
+}
+
+void tinyrl_output_consume(struct tinyrl *this, size_t len)
+{
+	assert(len <= this->output_end - this->output_start);
+
+	this->output_start += len;
+	if (this->output_start == this->output_end) {
+		this->output_start = 0;
+		this->output_end = 0;
 	}
-	return result;
 }
 
 /*
@@ -838,28 +2747,19 @@ bool tinyrl_insert_text_len(struct tinyrl *this, const char *text, unsigned delt
 	 * references are in sync
 	 */
 	changed_line(this);
+	tinyrl_line_changed(this, this->point);
 
-	if ((delta + this->end) > (this->buffer_size)) {
-		/* extend the current buffer */
-		if (!tinyrl_extend_line_buffer(this, this->end + delta)) {
-			return false;
-		}
-	}
-
-	if (this->point < this->end) {
-		/* move the current text to the right (including the terminator) */
-		memmove(&this->buffer[this->point + delta],
-			&this->buffer[this->point],
-			(this->end - this->point) + 1);
-	} else {
-		/* terminate the string */
-		this->buffer[this->end + delta] = '\0';
+	/* extend the current buffer, within any limit */
+	if (!tinyrl_extend_line_buffer(this, this->end + delta)) {
+		return false;
 	}
 
-	/* insert the new text */
+	/* insert the new text at the start of the gap */
+	tinyrl_gap_move(this, this->point);
 	strncpy(&this->buffer[this->point], text, delta);
 
 	/* now update the indexes */
+	this->gap += delta;
 	this->point += delta;
 	this->end += delta;
 
@@ -883,11 +2783,12 @@ void tinyrl_delete_text(struct tinyrl *this, unsigned start, unsigned end)
 		return;
 
 	changed_line(this);
+	tinyrl_line_changed(this, start);
 
-	/* move any text which is left, including terminator */
+	/* the text joins the end of the gap */
 	delta = end - start;
-	memmove(&this->buffer[start],
-		&this->buffer[start + delta], this->end + 1 - end);
+	tinyrl_gap_move(this, end);
+	this->gap = start;
 	this->end -= delta;
 
 	/* now adjust the indexs */
@@ -900,70 +2801,66 @@ void tinyrl_delete_text(struct tinyrl *this, unsigned start, unsigned end)
 	}
 }
 
-static void tinyrl_bind_keyseq(struct tinyrl *this, const char *seq,
-			       tinyrl_key_func_t *handler, void *context)
-{
-	struct tinyrl_keymap *keymap;
-	unsigned char key;
-
-	if (!*seq)
-		return;
-
-	keymap = this->keymap;
-	key = *seq++;
-
-	while (*seq) {
-		if (!keymap->keymap[key])
-			keymap->keymap[key] = tinyrl_keymap_new();
-		keymap = keymap->keymap[key];
-		key = *seq++;
-	}
-
-	keymap->handler[key] = handler;
-	keymap->context[key] = context;
-}
-
-void tinyrl_bind_special(struct tinyrl *this, enum tinyrl_key key,
+bool tinyrl_bind_special(struct tinyrl *this, enum tinyrl_key key,
 			 tinyrl_key_func_t *handler, void *context)
 {
 	switch (key) {
 	case TINYRL_KEY_UP:
-		tinyrl_bind_keyseq(this, ESCAPESTR "[A", handler, context);
-		break;
+		return tinyrl_bind_keyseq(this, ESCAPESTR "[A", handler, context);
 	case TINYRL_KEY_DOWN:
-		tinyrl_bind_keyseq(this, ESCAPESTR "[B", handler, context);
-		break;
+		return tinyrl_bind_keyseq(this, ESCAPESTR "[B", handler, context);
 	case TINYRL_KEY_LEFT:
-		tinyrl_bind_keyseq(this, ESCAPESTR "[D", handler, context);
-		break;
+		return tinyrl_bind_keyseq(this, ESCAPESTR "[D", handler, context);
 	case TINYRL_KEY_RIGHT:
-		tinyrl_bind_keyseq(this, ESCAPESTR "[C", handler, context);
-		break;
+		return tinyrl_bind_keyseq(this, ESCAPESTR "[C", handler, context);
 	case TINYRL_KEY_HOME:
-		tinyrl_bind_keyseq(this, ESCAPESTR "OH", handler, context);
-		break;
+		return tinyrl_bind_keyseq(this, ESCAPESTR "OH", handler, context);
 	case TINYRL_KEY_END:
-		tinyrl_bind_keyseq(this, ESCAPESTR "OF", handler, context);
-		break;
+		return tinyrl_bind_keyseq(this, ESCAPESTR "OF", handler, context);
 	case TINYRL_KEY_INSERT:
-		tinyrl_bind_keyseq(this, ESCAPESTR "[2~", handler, context);
-		break;
+		return tinyrl_bind_keyseq(this, ESCAPESTR "[2~", handler, context);
 	case TINYRL_KEY_DELETE:
-		tinyrl_bind_keyseq(this, ESCAPESTR "[3~", handler, context);
-		break;
+		return tinyrl_bind_keyseq(this, ESCAPESTR "[3~", handler, context);
 	}
+	return true;
 }
 
-void tinyrl_bind_key(struct tinyrl *this, unsigned char key,
+bool tinyrl_bind_key(struct tinyrl *this, unsigned char key,
 		     tinyrl_key_func_t *handler, void *context)
 {
-	this->keymap->handler[key] = handler;
-	this->keymap->context[key] = context;
+	const struct tinyrl_keymap_entry *entry;
+	struct tinyrl_keymap_entry *own;
+
+	entry = tinyrl_keymap_root(this, key);
+	if (entry->handler == handler && entry->context == context)
+		return true;
+	own = tinyrl_keymap_root_own(this, key);
+	if (!own)
+		return false;
+	own->handler = handler;
+	own->context = context;
+	return true;
+}
+
+void tinyrl_grab_keys(struct tinyrl *this,
+		      tinyrl_key_func_t *handler, void *context)
+{
+	this->grab = handler;
+	this->grab_context = context;
 }
 
 void tinyrl_crlf(struct tinyrl *this)
 {
-	tinyrl_printf(this, "\n");
+	/* show any keys handled since the last redisplay before moving on */
+	if (this->redisplay_pending)
+		tinyrl_display(this);
+	this->redisplay_pending = false;
+
+	/* leave the cursor below the whole line */
+	if (this->displayed && this->cursor_row + 1 < this->frame.rows)
+		tinyrl_cursor_move(this, this->frame.rows - 1, 0);
+	tinyrl_output_string(this, "\n");
+	tinyrl_flush(this);
 }
 
 /*
@@ -971,23 +2868,25 @@ void tinyrl_crlf(struct tinyrl *this)
  */
 void tinyrl_ding(struct tinyrl *this)
 {
-	tinyrl_printf(this, "\x7");
-	fflush(this->ostream);
+	tinyrl_output_string(this, "\x7");
+	tinyrl_flush(this);
 }
 
 void tinyrl_reset_line_state(struct tinyrl *this)
 {
 	/* start from scratch */
-	free(this->last_buffer);
-	this->last_buffer = NULL;
+	this->displayed = false;
 
 	tinyrl_redisplay(this);
 }
 
 void tinyrl_set_line(struct tinyrl *this, const char *text)
 {
+	/* leave the buffer as a string to come back to */
+	tinyrl_line_text(this);
 	this->line = text ?: this->buffer;
 	this->point = this->end = strlen(this->line);
+	tinyrl_line_changed(this, 0);
 }
 
 void tinyrl_replace_line(struct tinyrl *this, const char *text)
@@ -996,14 +2895,29 @@ void tinyrl_replace_line(struct tinyrl *this, const char *text)
 
 	if (tinyrl_extend_line_buffer(this, new_len)) {
 		strcpy(this->buffer, text);
-		this->point = this->end = new_len;
+		this->buffer[this->buffer_size] = '\0';
+		this->line = this->buffer;
+		this->gap = this->point = this->end = new_len;
+		tinyrl_line_changed(this, 0);
 	}
 	tinyrl_redisplay(this);
 }
 
+void tinyrl_set_prompt(struct tinyrl *this, const char *prompt)
+{
+	this->prompt = prompt;
+	tinyrl_line_changed(this, 0);
+}
+
+const char *tinyrl_get_prompt(const struct tinyrl *this)
+{
+	return this->prompt;
+}
+
 const char *tinyrl_get_line(const struct tinyrl *this)
 {
-	return this->line;
+	/* closing the gap only rearranges the buffer */
+	return tinyrl_line_text((struct tinyrl *)this);
 }
 
 unsigned tinyrl_get_point(const struct tinyrl *this)
@@ -1011,14 +2925,31 @@ unsigned tinyrl_get_point(const struct tinyrl *this)
 	return this->point;
 }
 
+void tinyrl_set_point(struct tinyrl *this, unsigned point)
+{
+	this->point = point < this->end ? point : this->end;
+}
+
 size_t tinyrl__get_width(const struct tinyrl *this)
 {
-	struct winsize ws;
+	if (this->width
+	    && (this->width_fixed || this->width_resizes == tinyrl_resizes))
+		return this->width;
 
-	if (ioctl(fileno(this->ostream), TIOCGWINSZ, &ws) != -1 && ws.ws_col)
-		return ws.ws_col;
+	return tinyrl_query_width(this);
+}
 
-	return 80;
+void tinyrl_set_width(struct tinyrl *this, size_t width)
+{
+	this->width = width;
+	this->width_fixed = width != 0;
+	if (this->displayed && !this->done)
+		tinyrl_redisplay(this);
+}
+
+void tinyrl_window_changed(void)
+{
+	tinyrl_resizes++;
 }
 
 void tinyrl_done(struct tinyrl *this)
@@ -1026,18 +2957,76 @@ void tinyrl_done(struct tinyrl *this)
 	this->done = true;
 }
 
+void tinyrl_enable_script_echo(struct tinyrl *this)
+{
+	this->script_echo = true;
+}
+
+void tinyrl_disable_script_echo(struct tinyrl *this)
+{
+	this->script_echo = false;
+}
+
 void tinyrl_enable_echo(struct tinyrl *this)
 {
 	this->echo_enabled = true;
+	tinyrl_line_changed(this, 0);
 }
 
 void tinyrl_disable_echo(struct tinyrl *this, char echo_char)
 {
 	this->echo_enabled = false;
 	this->echo_char = echo_char;
+	tinyrl_line_changed(this, 0);
 }
 
 void tinyrl_limit_line_length(struct tinyrl *this, unsigned length)
 {
 	this->max_line_length = length;
 }
+
+void tinyrl_limit_line_buffer(struct tinyrl *this, size_t size)
+{
+	this->max_buffer_size = size;
+}
+
+void tinyrl_set_scroll_threshold(struct tinyrl *this, size_t len)
+{
+	this->scroll_threshold = len;
+}
+
+void tinyrl_set_escape_timeout(struct tinyrl *this, int timeout)
+{
+	this->escape_timeout = timeout;
+}
+
+void tinyrl_enable_bracketed_paste(struct tinyrl *this)
+{
+	this->bracketed_paste = true;
+}
+
+void tinyrl_disable_bracketed_paste(struct tinyrl *this)
+{
+	this->bracketed_paste = false;
+}
+
+void tinyrl_enable_typeahead(struct tinyrl *this, int max_latency)
+{
+	this->typeahead = true;
+	this->typeahead_latency = max_latency;
+}
+
+void tinyrl_disable_typeahead(struct tinyrl *this)
+{
+	this->typeahead = false;
+}
+
+void tinyrl_enable_insert_delete(struct tinyrl *this)
+{
+	this->insert_delete = true;
+}
+
+void tinyrl_disable_insert_delete(struct tinyrl *this)
+{
+	this->insert_delete = false;
+}
@@ -35,9 +35,37 @@ enum tinyrl_key {
  */
 typedef bool tinyrl_key_func_t(void *context, char *key);
 
+/**
+ * Status flags returned by the tinyrl_feed() family of functions.
+ */
+enum tinyrl_feed_status {
+	/** output is waiting to be sent, see tinyrl_output() */
+	TINYRL_FEED_OUTPUT = 1,
+	/** a line has been read, see tinyrl_feed_line() */
+	TINYRL_FEED_LINE = 2,
+	/** the input has ended */
+	TINYRL_FEED_EOF = 4,
+};
+
+/**
+ * Counts of the output produced by an instance.
+ */
+struct tinyrl_output_stats {
+	/** bytes of output, including those of tinyrl_printf() */
+	unsigned long long bytes;
+	/** write() calls made on the ostream */
+	unsigned long long writes;
+	/** redisplays of the line */
+	unsigned long long frames;
+};
+
 /* exported functions */
 struct tinyrl *tinyrl_new(FILE * instream, FILE * outstream);
 
+/**
+ * Add formatted text to the output.  It is written out along with the
+ * next line, redisplay or wait for input, not by each call.
+ */
 /*lint -esym(534,tinyrl_printf)  Ignoring return value of function */
 int tinyrl_printf(struct tinyrl *instance, const char *fmt, ...);
 
@@ -47,13 +75,125 @@ void tinyrl_done(struct tinyrl *instance);
 
 size_t tinyrl__get_width(const struct tinyrl *instance);
 
+/**
+ * Set the width of the terminal, for example as reported by telnet
+ * NAWS or a web terminal.  The line is redisplayed to fit.  A width of
+ * 0 goes back to asking the terminal for its width.
+ */
+void tinyrl_set_width(struct tinyrl *instance, size_t width);
+
+/**
+ * Notify that the terminal window has been resized.
+ *
+ * The terminal width is cached, and is only asked for again at the
+ * start of each line or after this has been called.  This is
+ * async-signal-safe so it can be called from a SIGWINCH handler.  If
+ * that handler is installed without SA_RESTART, then the interrupted
+ * read lets the line be redisplayed straight away.
+ */
+void tinyrl_window_changed(void);
+
 char *tinyrl_readline(struct tinyrl *instance, const char *prompt);
 
-void tinyrl_bind_key(struct tinyrl *instance, unsigned char key,
+/**
+ * Read a line as tinyrl_readline() does, but lend it rather than
+ * returning a copy.
+ *
+ * The line stays valid, and len holds its length, until the next line
+ * is started on the instance.  Its buffer is then reused, so there are
+ * no allocations per line.  The lines of a script which is a regular
+ * file are read in place from a read-only mapping, so each is copied
+ * into that buffer to be terminated.
+ *
+ * \return the line, or NULL at the end of the input
+ */
+const char *tinyrl_readline_view(struct tinyrl *instance, const char *prompt,
+				 size_t *len);
+
+/**
+ * Create an instance which is driven by an event loop rather than by
+ * blocking reads.  Input is pushed in with tinyrl_feed() as it arrives,
+ * and output collects in a buffer which is drained with tinyrl_output().
+ */
+struct tinyrl *tinyrl_session_new(void);
+
+/**
+ * Start reading a line, as tinyrl_readline() would.  Any input that
+ * was fed after the previous line was completed is handled now.
+ *
+ * \return a combination of enum tinyrl_feed_status flags
+ */
+int tinyrl_feed_start(struct tinyrl *instance, const char *prompt);
+
+/**
+ * Handle input for a session.  A len of 0 signals the end of the input.
+ *
+ * Once TINYRL_FEED_LINE is returned any further input is buffered until
+ * the next tinyrl_feed_start().
+ *
+ * \return a combination of enum tinyrl_feed_status flags
+ */
+int tinyrl_feed(struct tinyrl *instance, const char *bytes, size_t len);
+
+/**
+ * Call this when the escape timeout (see tinyrl_set_escape_timeout())
+ * expires after an incomplete escape sequence was fed, so that it can be
+ * handled as it stands.
+ *
+ * \return a combination of enum tinyrl_feed_status flags
+ */
+int tinyrl_feed_timeout(struct tinyrl *instance);
+
+/**
+ * Take the line that was read after TINYRL_FEED_LINE was returned.
+ * As with tinyrl_readline() the caller must free it.
+ */
+char *tinyrl_feed_line(struct tinyrl *instance);
+
+/**
+ * Take the line that was read, as tinyrl_feed_line() does, but lend it
+ * rather than returning a copy.  It stays valid until the next
+ * tinyrl_feed_start().
+ */
+const char *tinyrl_feed_line_view(struct tinyrl *instance, size_t *len);
+
+/**
+ * Get the output waiting to be sent for a session.
+ */
+const char *tinyrl_output(const struct tinyrl *instance, size_t *len);
+
+/**
+ * Discard len bytes of the waiting output, once they have been sent.
+ */
+void tinyrl_output_consume(struct tinyrl *instance, size_t len);
+
+/**
+ * Get the counts of the output produced so far, for example to measure
+ * the bytes sent per keystroke.
+ */
+void tinyrl_get_output_stats(const struct tinyrl *instance,
+			     struct tinyrl_output_stats *stats);
+
+/**
+ * Bind a key, or the escape sequence of a special key, to handler.
+ *
+ * \return false if memory for the binding couldn't be allocated, in
+ * which case the bindings are unchanged
+ */
+bool tinyrl_bind_key(struct tinyrl *instance, unsigned char key,
 		     tinyrl_key_func_t *handler, void *context);
-void tinyrl_bind_special(struct tinyrl *instance, enum tinyrl_key key,
+bool tinyrl_bind_special(struct tinyrl *instance, enum tinyrl_key key,
 			 tinyrl_key_func_t *handler, void *context);
 
+/**
+ * Pass every key to handler before the binding of the key, for example
+ * to run a mode such as an incremental search.  If the handler returns
+ * false then the key is handled by its binding as usual.  A NULL
+ * handler ends the grab, as does starting the next line.
+ */
+void tinyrl_grab_keys(struct tinyrl *instance,
+		      tinyrl_key_func_t *handler, void *context);
+
 void tinyrl_crlf(struct tinyrl *instance);
 void tinyrl_ding(struct tinyrl *instance);
 
@@ -71,15 +211,31 @@ void tinyrl_set_line(struct tinyrl *instance, const char *text);
 
 void tinyrl_replace_line(struct tinyrl *instance, const char *text);
 
+/**
+ * Change the prompt of the line being read.  As with the prompt passed
+ * to tinyrl_readline() it must stay valid while it is in use.
+ */
+void tinyrl_set_prompt(struct tinyrl *instance, const char *prompt);
+
+const char *tinyrl_get_prompt(const struct tinyrl *instance);
+
 /**
  * This operation returns the current line in use by the tinyrl instance
  * NB. the pointer will become invalid after any further operation on the 
  * instance.
+ *
+ * The line is edited with a gap at the point, which this closes, so
+ * avoid calling it on every key press for long lines.
  */
 const char *tinyrl_get_line(const struct tinyrl *instance);
 
 unsigned tinyrl_get_point(const struct tinyrl *instance);
 
+/**
+ * Move the insertion point, to no further than the end of the line.
+ */
+void tinyrl_set_point(struct tinyrl *instance, unsigned point);
+
 /**
  * Disable echoing of input characters when a line in input.
  * 
@@ -94,6 +250,72 @@ void tinyrl_disable_echo(struct tinyrl *instance, char echo_char);
  */
 void tinyrl_enable_echo(struct tinyrl *instance);
 
+/**
+ * Echo the prompt and each line read from a stream which isn't a
+ * terminal, such as a script. (This is the default behaviour)
+ */
+void tinyrl_enable_script_echo(struct tinyrl *instance);
+
+/**
+ * Read lines from a stream which isn't a terminal without any output,
+ * so that replaying a script only costs the commands it runs.
+ */
+void tinyrl_disable_script_echo(struct tinyrl *instance);
+
+/**
+ * Set how long to wait, in milliseconds, for the rest of an escape
+ * sequence before treating ESC as a key on its own.
+ *
+ * The default is 100ms.  Links with high latency may need more.
+ */
+void tinyrl_set_escape_timeout(struct tinyrl *instance, int timeout);
+
+/**
+ * Enable xterm bracketed paste mode for this instance.
+ *
+ * Pasted text is inserted into the line as a single block instead of
+ * being handled as key presses, so pasted line breaks cannot submit a
+ * partial command.  They are inserted as spaces.
+ */
+void tinyrl_enable_bracketed_paste(struct tinyrl *instance);
+
+/**
+ * Disable bracketed paste mode. (This is the default behaviour)
+ */
+void tinyrl_disable_bracketed_paste(struct tinyrl *instance);
+
+/**
+ * Enable typeahead mode for this instance.
+ *
+ * While more keys are already waiting to be handled the line is not
+ * redisplayed, so that fast typing or scripted input over a slow link
+ * doesn't send frames the terminal would immediately overwrite.  The
+ * display is never left more than max_latency milliseconds out of date
+ * while keys are arriving.
+ */
+void tinyrl_enable_typeahead(struct tinyrl *instance, int max_latency);
+
+/**
+ * Redisplay the line after every key. (This is the default behaviour)
+ */
+void tinyrl_disable_typeahead(struct tinyrl *instance);
+
+/**
+ * Allow the terminal's insert and delete character sequences (ICH and
+ * DCH) to be used when redisplaying.
+ *
+ * Text after an insertion or deletion is then shifted along its row
+ * rather than rewritten, when that sends fewer bytes.  Only enable this
+ * for terminals which support these sequences.
+ */
+void tinyrl_enable_insert_delete(struct tinyrl *instance);
+
+/**
+ * Only use cursor movement and erase sequences when redisplaying.
+ * (This is the default behaviour)
+ */
+void tinyrl_disable_insert_delete(struct tinyrl *instance);
+
 /**
  * Limit maximum line length
  *
@@ -101,5 +323,26 @@ void tinyrl_enable_echo(struct tinyrl *instance);
  */
 void tinyrl_limit_line_length(struct tinyrl *instance, unsigned length);
 
+/**
+ * Limit the size of the line buffer which is kept for the next line.
+ *
+ * The buffer grows as needed while a line is read.  Once the line is
+ * finished a buffer bigger than size is shrunk back, so that one long
+ * paste doesn't hold on to memory.  0 frees it after every line.  The
+ * default is 256 bytes.
+ */
+void tinyrl_limit_line_buffer(struct tinyrl *instance, size_t size);
+
+/**
+ * Set the length beyond which a line is shown on a single row, scrolled
+ * sideways to keep the point in view.
+ *
+ * Very long lines, such as pasted documents, can then still be edited
+ * quickly, as only the part which fits on the row is laid out and
+ * redisplayed.  0 always shows the whole line.  The default is 4096
+ * bytes.
+ */
+void tinyrl_set_scroll_threshold(struct tinyrl *instance, size_t len);
+
 #endif
 /** @} tinyrl_tinyrl */